@@ -24,65 +24,88 @@ namespace nn
 
     };
 
-    template <typename TYPE, actmode_t ACT_MODE, std::size_t DIM>
-    std::array<TYPE, DIM> apply(Activation<TYPE, ACT_MODE, DIM>& activation, auto in_vector) noexcept
+    namespace detail
     {
-        std::array<TYPE, DIM> out_vector;
-
-        if constexpr (ACT_MODE == RELU)
+        // Shared by the training and the inference path
+        template <typename TYPE, actmode_t ACT_MODE, std::size_t DIM>
+        void activate(const TYPE* in_vector, TYPE* out_vector) noexcept
         {
-            for (auto i = in_vector.begin(),
-                j = out_vector.begin(),
-                k = activation.output.begin(); i != in_vector.end(); ++i, ++j, ++k)
+            if constexpr (ACT_MODE == RELU)
             {
-                *k = *j = std::max(static_cast<TYPE>(0), *i);
+                for (std::size_t i = 0; i < DIM; ++i)
+                {
+                    out_vector[i] = std::max(static_cast<TYPE>(0), in_vector[i]);
+                }
             }
-        }
-        else if constexpr (ACT_MODE == SOFTMAX)
-        {
-            // Find the max value in the input vector
-            auto max_val = in_vector[0];
-            for (auto i = in_vector.begin(); i != in_vector.end(); ++i)
+            else if constexpr (ACT_MODE == SOFTMAX)
             {
-                max_val = std::max(max_val, *i);
-            }
+                // Find the max value in the input vector
+                TYPE max_val = in_vector[0];
+                for (std::size_t i = 0; i < DIM; ++i)
+                {
+                    max_val = std::max(max_val, in_vector[i]);
+                }
 
-            // Subtract the max value from all input values
-            for (auto i = in_vector.begin(),
-                j = out_vector.begin(); i != in_vector.end(); ++i, ++j)
-            {  
-                *j = *i - max_val;
-            }
+                // Compute exponentials of the shifted inputs and sum them up
+                TYPE sum = 0;
+                for (std::size_t i = 0; i < DIM; ++i)
+                {
+                    sum += (out_vector[i] = std::exp(in_vector[i] - max_val));
+                }
 
-            // Compute exponentials and sum them up
-            auto sum = 0;
-            for (auto i = out_vector.begin(); i != out_vector.end(); ++i)
-            {
-                sum += std::exp(*i);
+                // Normalize the output vector
+                for (std::size_t i = 0; i < DIM; ++i)
+                {
+                    out_vector[i] /= sum;
+                }
             }
-
-            // Normalize the output vector
-            for (auto i = out_vector.begin(),
-                j = activation.output.begin(); i != out_vector.end(); ++i, ++j)
+            else if constexpr (ACT_MODE == SIGMOID)
             {
-                *j = (*i /= sum);
+                // SIGMOID IMPLEMENTATION
+                for (std::size_t i = 0; i < DIM; ++i)
+                {
+                    out_vector[i] = (TYPE)1 / ((TYPE)1 + std::exp(in_vector[i]));
+                }
             }
         }
-        else if constexpr (ACT_MODE == SIGMOID)
+    }
+
+    template <typename TYPE, actmode_t ACT_MODE, std::size_t DIM>
+    std::array<TYPE, DIM> apply(Activation<TYPE, ACT_MODE, DIM>& activation, auto in_vector) noexcept
+    {
+        std::array<TYPE, DIM> out_vector;
+
+        detail::activate<TYPE, ACT_MODE, DIM>(std::data(in_vector), out_vector.data());
+        activation.output = out_vector;
+
+        return out_vector;
+    }
+
+    // Inference, leaves the layer untouched
+    template <typename TYPE, actmode_t ACT_MODE, std::size_t DIM>
+    std::array<TYPE, DIM> infer(const Activation<TYPE, ACT_MODE, DIM>&, const std::array<TYPE, DIM>& in_vector) noexcept
+    {
+        std::array<TYPE, DIM> out_vector;
+        detail::activate<TYPE, ACT_MODE, DIM>(in_vector.data(), out_vector.data());
+
+        return out_vector;
+    }
+
+    // Inference on N samples stored one after the other
+    template <std::size_t N, typename TYPE, actmode_t ACT_MODE, std::size_t DIM>
+    std::array<TYPE, DIM*N> infer_batch(const Activation<TYPE, ACT_MODE, DIM>&, const std::array<TYPE, DIM*N>& in_batch) noexcept
+    {
+        std::array<TYPE, DIM*N> out_batch;
+        for (std::size_t s = 0; s < N; ++s)
         {
-            // SIGMOID IMPLEMENTATION
-            for (auto i = in_vector.begin(), j = out_vector.begin(), k = activation.output.begin();
-                i != in_vector.end(); ++i, ++j, ++k)
-            {
-                *k = *j = (TYPE)1 / ((TYPE)1 + std::exp(*i));
-            }
+            detail::activate<TYPE, ACT_MODE, DIM>(in_batch.data() + s * DIM, out_batch.data() + s * DIM);
         }
 
-        return out_vector;
+        return out_batch;
     }
 
     template<typename TYPE, actmode_t ACT_MODE, std::size_t DIM>
-    std::array<TYPE, DIM> update(const Activation<TYPE, ACT_MODE, DIM>& activation, auto in_gradient) noexcept
+    std::array<TYPE, DIM> backprop(const Activation<TYPE, ACT_MODE, DIM>& activation, auto in_gradient) noexcept
     {
         std::array<TYPE, DIM> out_gradient{};
 
@@ -103,6 +126,29 @@ namespace nn
 
         return out_gradient;
     }
+
+    // Activations have no trainable parameters
+    template<typename TYPE, actmode_t ACT_MODE, std::size_t DIM>
+    void step(Activation<TYPE, ACT_MODE, DIM>&) noexcept
+    {}
+
+    template<typename TYPE, actmode_t ACT_MODE, std::size_t DIM>
+    std::array<TYPE, DIM> update(const Activation<TYPE, ACT_MODE, DIM>& activation, auto in_gradient) noexcept
+    {
+        return backprop(activation, in_gradient);
+    }
+
+    template<typename TYPE, actmode_t ACT_MODE, std::size_t DIM>
+    void parameters(Activation<TYPE, ACT_MODE, DIM>&, auto&&) noexcept
+    {}
+
+    template<typename TYPE, actmode_t ACT_MODE, std::size_t DIM>
+    void gradients(Activation<TYPE, ACT_MODE, DIM>&, auto&&) noexcept
+    {}
+
+    template<typename TYPE, actmode_t ACT_MODE, std::size_t DIM>
+    void refresh(Activation<TYPE, ACT_MODE, DIM>&) noexcept
+    {}
 }
 
 #endif
\ No newline at end of file
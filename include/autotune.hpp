@@ -0,0 +1,185 @@
+#ifndef _AUTOTUNE_H
+#define _AUTOTUNE_H
+
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <optional>
+#include <fstream>
+#include <mutex>
+#include <chrono>
+#include <algorithm>
+#include <cstdlib>
+#include <cstdio>
+#include <span>
+#include <initializer_list>
+#include <atomic>
+
+#include <unistd.h>
+
+namespace nn
+{
+    // Kernel autotuning.
+    //
+    // A kernel with several implementations (tile sizes, loop orders, ...) identifies each one by a number.
+    // autotune() times every candidate once per CPU model and shape and remembers the fastest in the
+    // tuning cache, a text file with one "key<TAB>candidate" line per entry. Layers look their kernel up in
+    // the cache when they are constructed; on a miss they keep their default unless autotune_on_miss is set.
+    //
+    // The cache file is NN_TUNING_CACHE (default: nn_tuning.cache in the working directory) and
+    // autotune_on_miss is enabled by setting NN_AUTOTUNE.
+
+    // CPU model name from /proc/cpuinfo, "unknown" when it is not available
+    inline const std::string& cpu_model()
+    {
+        static const std::string model = []
+        {
+            std::ifstream cpuinfo("/proc/cpuinfo");
+            std::string line;
+            while (std::getline(cpuinfo, line))
+            {
+                if (line.rfind("model name", 0) == 0)
+                {
+                    std::size_t begin = line.find(':');
+                    if (begin == std::string::npos) break;
+                    begin = line.find_first_not_of(" \t", begin + 1);
+                    if (begin == std::string::npos) break;
+                    return line.substr(begin);
+                }
+            }
+            return std::string{"unknown"};
+        }();
+
+        return model;
+    }
+
+    // "<cpu model>|<kernel>|<d0>x<d1>x..."
+    inline std::string tuning_key(std::string_view kernel, std::initializer_list<std::size_t> shape)
+    {
+        std::string key = cpu_model();
+        key += '|';
+        key += kernel;
+        key += '|';
+        for (auto dim = shape.begin(); dim != shape.end(); ++dim)
+        {
+            if (dim != shape.begin()) key += 'x';
+            key += std::to_string(*dim);
+        }
+
+        return key;
+    }
+
+    struct TuningCache
+    {
+        public:
+
+            std::string path;
+            bool autotune_on_miss;
+
+            TuningCache(std::string path, bool autotune_on_miss = false) :
+                path{std::move(path)},
+                autotune_on_miss{autotune_on_miss}
+            {
+                load();
+            }
+
+            std::optional<std::size_t> find(const std::string& key)
+            {
+                std::lock_guard lock{mutex};
+                auto entry = entries.find(key);
+                if (entry == entries.end()) return std::nullopt;
+
+                return entry->second;
+            }
+
+            // Record a winner and rewrite the file. The entries other processes stored meanwhile are merged in
+            // first, and the file is written under a name private to this call, then renamed over the cache,
+            // so that concurrent writers and readers always see a whole file.
+            void store(const std::string& key, std::size_t candidate)
+            {
+                static std::atomic<std::size_t> counter{0};
+
+                std::lock_guard lock{mutex};
+                load();
+                entries[key] = candidate;
+
+                const std::string tmp_path = path + "." + std::to_string(getpid()) + "." + std::to_string(counter++) + ".tmp";
+                {
+                    std::ofstream file(tmp_path, std::ios::trunc);
+                    for (const auto& [k, v] : entries)
+                    {
+                        file << k << '\t' << v << '\n';
+                    }
+                    if (!file)
+                    {
+                        std::remove(tmp_path.c_str());
+                        return;
+                    }
+                }
+                if (std::rename(tmp_path.c_str(), path.c_str()) != 0)
+                    std::remove(tmp_path.c_str());
+            }
+
+        private:
+
+            std::unordered_map<std::string, std::size_t> entries;
+            std::mutex mutex;
+
+            // Read the file over the entries in memory
+            void load()
+            {
+                std::ifstream file(path);
+                std::string line;
+                while (std::getline(file, line))
+                {
+                    const std::size_t tab = line.rfind('\t');
+                    if (tab == std::string::npos) continue;
+                    entries[line.substr(0, tab)] = std::strtoull(line.c_str() + tab + 1, nullptr, 10);
+                }
+            }
+    };
+
+    // The cache shared by all layers
+    inline TuningCache& tuning_cache()
+    {
+        static TuningCache cache{
+            std::getenv("NN_TUNING_CACHE") ? std::getenv("NN_TUNING_CACHE") : "nn_tuning.cache",
+            std::getenv("NN_AUTOTUNE") != nullptr};
+
+        return cache;
+    }
+
+    // Time run(candidate) for every candidate, keeping the best of `repetitions` runs, store the fastest under key
+    template <typename RUN>
+    std::size_t autotune(const std::string& key, std::span<const std::size_t> candidates, RUN&& run, std::size_t repetitions = 5)
+    {
+        std::size_t best = candidates.front();
+        auto best_time = std::chrono::steady_clock::duration::max();
+
+        for (std::size_t candidate : candidates)
+        {
+            // Warm up caches and the branch predictor
+            run(candidate);
+
+            auto fastest = std::chrono::steady_clock::duration::max();
+            for (std::size_t r = 0; r < repetitions; ++r)
+            {
+                const auto start = std::chrono::steady_clock::now();
+                run(candidate);
+                fastest = std::min(fastest, std::chrono::steady_clock::now() - start);
+            }
+
+            if (fastest < best_time)
+            {
+                best_time = fastest;
+                best = candidate;
+            }
+        }
+
+        tuning_cache().store(key, best);
+
+        return best;
+    }
+}
+
+#endif
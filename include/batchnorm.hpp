@@ -0,0 +1,310 @@
+#ifndef _BATCHNORM_H
+#define _BATCHNORM_H
+
+#include <array>
+#include <cmath>
+#include <cstddef>
+#include <cassert>
+#include <span>
+#include <vector>
+#include <dense.hpp>
+
+namespace nn
+{
+    // Batch Normalization Layer
+    //
+    // During training apply_batch() normalizes every sample of a batch with the mean and variance of that
+    // batch, and feeds the batch into a Welford accumulator (batch_count, batch_mean, batch_m2). step()
+    // applies the gradients of gamma and beta, moves the accumulated statistics into running_mean and
+    // running_var with `momentum` and resets the accumulator; inference and fold() use the running statistics only.
+    // A single sample has no variance of its own: apply() and batches of one normalize with the running
+    // statistics, and step() then takes the squared distance of the sample from running_mean as its variance,
+    // so that running_var keeps moving with BATCH=1.
+    // The backward pass treats the batch statistics as constants and uses the last sample for gamma.
+    template <typename TYPE, std::size_t DIM>
+    struct BatchNorm
+    {
+        public:
+
+            std::array<TYPE, DIM> gamma;
+            std::array<TYPE, DIM> beta;
+            std::array<TYPE, DIM> running_mean;
+            std::array<TYPE, DIM> running_var;
+            TYPE learning_rate;
+            TYPE momentum;
+            TYPE epsilon;
+
+            std::size_t batch_count = 0;
+            std::array<TYPE, DIM> batch_mean{};
+            std::array<TYPE, DIM> batch_m2{};
+
+            // Gradients of gamma and beta from the last backprop()
+            std::array<TYPE, DIM> gamma_gradient{};
+            std::array<TYPE, DIM> beta_gradient{};
+
+            // Normalized input and 1/sqrt(var + epsilon) of the last sample, for the backward pass
+            std::array<TYPE, DIM> normalized{};
+            std::array<TYPE, DIM> inv_std{};
+
+            // Set by fold(), the layer is then the identity and can be dropped from the network
+            bool folded = false;
+
+            BatchNorm(TYPE learning_rate, TYPE momentum = static_cast<TYPE>(0.1), TYPE epsilon = static_cast<TYPE>(1e-5)) :
+                learning_rate{learning_rate},
+                momentum{momentum},
+                epsilon{epsilon}
+            {
+                gamma.fill(static_cast<TYPE>(1));
+                beta.fill(static_cast<TYPE>(0));
+                running_mean.fill(static_cast<TYPE>(0));
+                running_var.fill(static_cast<TYPE>(1));
+            }
+
+    };
+
+    namespace detail
+    {
+        // Welford update with N samples stored one after the other, vectorized over the features
+        template <std::size_t N, typename TYPE, std::size_t DIM>
+        void welford(BatchNorm<TYPE, DIM>& batchnorm, const TYPE* in_batch) noexcept
+        {
+            for (std::size_t s = 0; s < N; ++s)
+            {
+                const TYPE* x = in_batch + s * DIM;
+                const TYPE inv_count = static_cast<TYPE>(1) / static_cast<TYPE>(++batchnorm.batch_count);
+
+                for (std::size_t i = 0; i < DIM; ++i)
+                {
+                    const TYPE delta = x[i] - batchnorm.batch_mean[i];
+                    batchnorm.batch_mean[i] += delta * inv_count;
+                    batchnorm.batch_m2[i] += delta * (x[i] - batchnorm.batch_mean[i]);
+                }
+            }
+        }
+
+        // y = gamma * (x - mean) / sqrt(var + epsilon) + beta with the running statistics
+        template <typename TYPE, std::size_t DIM>
+        void normalize_running(const BatchNorm<TYPE, DIM>& batchnorm, const TYPE* in_vector, TYPE* out_vector) noexcept
+        {
+            for (std::size_t i = 0; i < DIM; ++i)
+            {
+                const TYPE scale = batchnorm.gamma[i] / std::sqrt(batchnorm.running_var[i] + batchnorm.epsilon);
+                out_vector[i] = (in_vector[i] - batchnorm.running_mean[i]) * scale + batchnorm.beta[i];
+            }
+        }
+    }
+
+    // Processing
+    template <typename TYPE, std::size_t DIM>
+    std::array<TYPE, DIM> apply(BatchNorm<TYPE, DIM>& batchnorm, const std::array<TYPE, DIM>& in_vector) noexcept
+    {
+        if (batchnorm.folded)
+            return in_vector;
+
+        std::array<TYPE, DIM> out_vector;
+        detail::welford<1>(batchnorm, in_vector.data());
+
+        for (std::size_t i = 0; i < DIM; ++i)
+        {
+            batchnorm.inv_std[i] = static_cast<TYPE>(1) / std::sqrt(batchnorm.running_var[i] + batchnorm.epsilon);
+            batchnorm.normalized[i] = (in_vector[i] - batchnorm.running_mean[i]) * batchnorm.inv_std[i];
+            out_vector[i] = batchnorm.gamma[i] * batchnorm.normalized[i] + batchnorm.beta[i];
+        }
+
+        return out_vector;
+    }
+
+    // Processing of a whole batch, every sample is normalized with the statistics of the batch
+    template <typename TYPE, std::size_t DIM>
+    std::vector<std::array<TYPE, DIM>> apply_batch(BatchNorm<TYPE, DIM>& batchnorm, const std::vector<std::array<TYPE, DIM>>& in_batch)
+    {
+        if (batchnorm.folded)
+            return in_batch;
+
+        std::vector<std::array<TYPE, DIM>> out_batch;
+        out_batch.reserve(in_batch.size());
+
+        if (in_batch.size() < 2)
+        {
+            for (const auto& in_vector : in_batch)
+                out_batch.push_back(apply(batchnorm, in_vector));
+
+            return out_batch;
+        }
+
+        // Mean and variance of this batch alone, the accumulator may already hold earlier samples
+        std::array<TYPE, DIM> mean{};
+        std::array<TYPE, DIM> m2{};
+        TYPE count = 0;
+        for (const auto& in_vector : in_batch)
+        {
+            detail::welford<1>(batchnorm, in_vector.data());
+
+            const TYPE inv_count = static_cast<TYPE>(1) / ++count;
+            for (std::size_t i = 0; i < DIM; ++i)
+            {
+                const TYPE delta = in_vector[i] - mean[i];
+                mean[i] += delta * inv_count;
+                m2[i] += delta * (in_vector[i] - mean[i]);
+            }
+        }
+
+        for (std::size_t i = 0; i < DIM; ++i)
+        {
+            batchnorm.inv_std[i] = static_cast<TYPE>(1) / std::sqrt(m2[i] / count + batchnorm.epsilon);
+        }
+
+        for (const auto& in_vector : in_batch)
+        {
+            std::array<TYPE, DIM>& out_vector = out_batch.emplace_back();
+            for (std::size_t i = 0; i < DIM; ++i)
+            {
+                batchnorm.normalized[i] = (in_vector[i] - mean[i]) * batchnorm.inv_std[i];
+                out_vector[i] = batchnorm.gamma[i] * batchnorm.normalized[i] + batchnorm.beta[i];
+            }
+        }
+
+        return out_batch;
+    }
+
+    // Inference, leaves the layer untouched
+    template <typename TYPE, std::size_t DIM>
+    std::array<TYPE, DIM> infer(const BatchNorm<TYPE, DIM>& batchnorm, const std::array<TYPE, DIM>& in_vector) noexcept
+    {
+        if (batchnorm.folded)
+            return in_vector;
+
+        std::array<TYPE, DIM> out_vector;
+        detail::normalize_running(batchnorm, in_vector.data(), out_vector.data());
+
+        return out_vector;
+    }
+
+    // Inference on N samples stored one after the other
+    template <std::size_t N, typename TYPE, std::size_t DIM>
+    std::array<TYPE, DIM*N> infer_batch(const BatchNorm<TYPE, DIM>& batchnorm, const std::array<TYPE, DIM*N>& in_batch) noexcept
+    {
+        if (batchnorm.folded)
+            return in_batch;
+
+        std::array<TYPE, DIM*N> out_batch;
+        for (std::size_t s = 0; s < N; ++s)
+        {
+            detail::normalize_running(batchnorm, in_batch.data() + s * DIM, out_batch.data() + s * DIM);
+        }
+
+        return out_batch;
+    }
+
+    // Backpropagation: store the gradients of gamma and beta and return the gradient of the input
+    template <typename TYPE, std::size_t DIM>
+    std::array<TYPE, DIM> backprop(BatchNorm<TYPE, DIM>& batchnorm, const std::array<TYPE, DIM>& in_gradient) noexcept
+    {
+        if (batchnorm.folded)
+            return in_gradient;
+
+        std::array<TYPE, DIM> out_gradient;
+
+        for (std::size_t i = 0; i < DIM; ++i)
+        {
+            out_gradient[i] = in_gradient[i] * batchnorm.gamma[i] * batchnorm.inv_std[i];
+            batchnorm.gamma_gradient[i] = in_gradient[i] * batchnorm.normalized[i];
+            batchnorm.beta_gradient[i] = in_gradient[i];
+        }
+
+        return out_gradient;
+    }
+
+    // Apply the gradients of the last backprop() and move the batch statistics into the running ones
+    template <typename TYPE, std::size_t DIM>
+    void step(BatchNorm<TYPE, DIM>& batchnorm) noexcept
+    {
+        if (batchnorm.folded)
+            return;
+
+        for (std::size_t i = 0; i < DIM; ++i)
+        {
+            batchnorm.gamma[i] -= batchnorm.learning_rate * batchnorm.gamma_gradient[i];
+            batchnorm.beta[i] -= batchnorm.learning_rate * batchnorm.beta_gradient[i];
+        }
+
+        // The unbiased variance of the batch; a single sample contributes its squared distance from the running mean
+        if (batchnorm.batch_count > 0)
+        {
+            const TYPE bessel = static_cast<TYPE>(batchnorm.batch_count > 1 ? batchnorm.batch_count - 1 : 1);
+            for (std::size_t i = 0; i < DIM; ++i)
+            {
+                const TYPE delta = batchnorm.batch_mean[i] - batchnorm.running_mean[i];
+                const TYPE batch_var = batchnorm.batch_count > 1 ? batchnorm.batch_m2[i] / bessel : delta * delta;
+
+                batchnorm.running_mean[i] += batchnorm.momentum * delta;
+                batchnorm.running_var[i] += batchnorm.momentum * (batch_var - batchnorm.running_var[i]);
+            }
+        }
+
+        batchnorm.batch_count = 0;
+        batchnorm.batch_mean.fill(static_cast<TYPE>(0));
+        batchnorm.batch_m2.fill(static_cast<TYPE>(0));
+    }
+
+    template <typename TYPE, std::size_t DIM>
+    std::array<TYPE, DIM> update(BatchNorm<TYPE, DIM>& batchnorm, const std::array<TYPE, DIM>& in_gradient) noexcept
+    {
+        std::array<TYPE, DIM> out_gradient = backprop(batchnorm, in_gradient);
+        step(batchnorm);
+
+        return out_gradient;
+    }
+
+    // Trainable parameters and running statistics, in a fixed order
+    template <typename TYPE, std::size_t DIM>
+    void parameters(BatchNorm<TYPE, DIM>& batchnorm, auto&& visit)
+    {
+        visit(std::span<TYPE>{batchnorm.gamma});
+        visit(std::span<TYPE>{batchnorm.beta});
+        visit(std::span<TYPE>{batchnorm.running_mean});
+        visit(std::span<TYPE>{batchnorm.running_var});
+    }
+
+    // Gradients of the last backprop(), followed by the accumulated batch statistics: replicas that average
+    // them move their running statistics the same way
+    template <typename TYPE, std::size_t DIM>
+    void gradients(BatchNorm<TYPE, DIM>& batchnorm, auto&& visit)
+    {
+        visit(std::span<TYPE>{batchnorm.gamma_gradient});
+        visit(std::span<TYPE>{batchnorm.beta_gradient});
+        visit(std::span<TYPE>{batchnorm.batch_mean});
+        visit(std::span<TYPE>{batchnorm.batch_m2});
+    }
+
+    template <typename TYPE, std::size_t DIM>
+    void refresh(BatchNorm<TYPE, DIM>&) noexcept
+    {}
+
+    // Merge the running statistics, gamma and beta into the Dense layer in front of the batch normalization:
+    //     W'[i][j] = W[i][j] * s[i],  b'[i] = (b[i] - mean[i]) * s[i] + beta[i],  s[i] = gamma[i] / sqrt(var[i] + epsilon)
+    // The batch normalization becomes the identity; remove it from the layers to make it free at serving time.
+    template <typename TYPE, std::size_t DIM1, std::size_t DIM2, std::size_t BATCH>
+    void fold(Dense<TYPE, DIM1, DIM2, BATCH>& dense, BatchNorm<TYPE, DIM2>& batchnorm) noexcept
+    {
+        assert(!batchnorm.folded);
+
+        edit_weights(dense, [&](std::array<TYPE, DIM1*DIM2>& weights)
+        {
+            for (std::size_t i = 0; i < DIM2; ++i)
+            {
+                const TYPE scale = batchnorm.gamma[i] / std::sqrt(batchnorm.running_var[i] + batchnorm.epsilon);
+                TYPE* row = weights.data() + i * DIM1;
+
+                for (std::size_t j = 0; j < DIM1; ++j)
+                {
+                    row[j] *= scale;
+                }
+                dense.bias_vector[i] = (dense.bias_vector[i] - batchnorm.running_mean[i]) * scale + batchnorm.beta[i];
+            }
+        });
+        batchnorm.folded = true;
+    }
+}
+
+#endif
@@ -7,6 +7,12 @@
 #include <cassert>
 #include <algorithm>
 #include <random>
+#include <vector>
+#include <type_traits>
+#include <memory>
+#include <utility>
+#include <autotune.hpp>
+#include <threadpool.hpp>
 
 #ifdef __CUDA_ARCH__
 #include <cublas_v2.h>
@@ -15,94 +21,459 @@
 namespace nn
 {
 
+    // Samples per batched forward pass in evaluate(), the batch the Dense kernels are tuned for
+    constexpr std::size_t INFER_BLOCK = 16;
+
+    namespace detail
+    {
+        // Multiply-adds below which splitting a kernel across the pool costs more than it saves
+        constexpr std::size_t PARALLEL_WORK = std::size_t{1} << 18;
+    }
+
     // Dense Layer
+    //
+    // weight_matrix is the canonical row-major view, one row of DIM1 input weights per output: [i * DIM1 + j].
+    // The kernels read packed_weights instead, where PANEL consecutive outputs are interleaved so that the
+    // innermost loop is a contiguous PANEL-wide multiply-add (one SIMD register), zero-padded up to PANELS*PANEL.
+    // weight_matrix is read through weights() and only written inside edit_weights(), which bumps version and
+    // repacks when the edit is done; packed_version records which version packed_weights was built from, so a
+    // stale packed copy is never used.
+    // kernel_tile is the number of samples the batched kernel keeps in registers, looked up in the tuning cache
+    // for the pool that is current at construction; call select_kernel() under a PoolScope to pick it for another.
     template <typename TYPE, std::size_t DIM1, std::size_t DIM2, std::size_t BATCH>
     struct Dense
     {
-        public:
+        private:
 
             std::array<TYPE, DIM1*DIM2> weight_matrix;
+
+        public:
+
+            static constexpr std::size_t PANEL = std::max<std::size_t>(1, 32 / sizeof(TYPE));
+            static constexpr std::size_t PANELS = (DIM2 + PANEL - 1) / PANEL;
+
             std::array<TYPE, DIM2> bias_vector;
             std::array<TYPE, DIM2> mean_output_vector = {static_cast<TYPE>(0)};
             TYPE learning_rate;
 
+            // Gradients of the last backprop(): the update rule moves every weight of row i by the same amount,
+            // so one value per row is enough
+            std::array<TYPE, DIM2> weight_gradient{};
+            std::array<TYPE, DIM2> bias_gradient{};
+
+            alignas(32) std::array<TYPE, PANELS*PANEL*DIM1> packed_weights;
+            std::size_t version = 0;
+            std::size_t packed_version = 0;
+            std::size_t kernel_tile = 4;
+
             Dense(std::initializer_list<TYPE> mat_init_list,
                 std::initializer_list<TYPE> bias_init_list,
-                TYPE learning_rate) : 
+                TYPE learning_rate) :
                 learning_rate{learning_rate}
             {
                 assert(mat_init_list.size() == DIM1*DIM2 && bias_init_list.size() == DIM2);
                 std::copy(mat_init_list.begin(), mat_init_list.end(), weight_matrix.begin());
                 std::copy(bias_init_list.begin(), bias_init_list.end(), bias_vector.begin());
+                pack();
+                select_kernel();
             }
 
             constexpr Dense(std::array<TYPE, DIM1*DIM2>&& mat_init, std::array<TYPE, DIM2>&& bias_init, TYPE learning_rate) :
                 weight_matrix{mat_init},
                 bias_vector{bias_init},
                 learning_rate{learning_rate}
-                {}
+                {
+                    pack();
+                    select_kernel();
+                }
 
             constexpr Dense(const std::array<TYPE, DIM1*DIM2>& mat_init, const std::array<TYPE, DIM2>& bias_init, TYPE learning_rate) :
                 weight_matrix{mat_init},
                 bias_vector{bias_init},
                 learning_rate{learning_rate}
-                {}
-            
+                {
+                    pack();
+                    select_kernel();
+                }
+
             Dense(TYPE learning_rate) : learning_rate{learning_rate}
             {
                 std::default_random_engine engine(std::random_device{}());
                 std::uniform_real_distribution<TYPE> dist(static_cast<TYPE>(0), static_cast<TYPE>(1));
                 std::generate(std::begin(weight_matrix), std::end(weight_matrix), [&]{ return dist(engine); });
                 std::generate(std::begin(bias_vector), std::end(bias_vector), [&]{ return dist(engine); });
+                pack();
+                select_kernel();
+            }
+
+            constexpr const std::array<TYPE, DIM1*DIM2>& weights() const noexcept
+            {
+                return weight_matrix;
+            }
+
+            template <typename T, std::size_t D1, std::size_t D2, std::size_t B, typename EDIT>
+            friend void edit_weights(Dense<T, D1, D2, B>& dense, EDIT&& edit);
+
+            // Rebuild packed_weights from weight_matrix
+            constexpr void pack() noexcept
+            {
+                for (std::size_t p = 0; p < PANELS; ++p)
+                {
+                    for (std::size_t j = 0; j < DIM1; ++j)
+                    {
+                        for (std::size_t r = 0; r < PANEL; ++r)
+                        {
+                            const std::size_t i = p * PANEL + r;
+                            packed_weights[(p * DIM1 + j) * PANEL + r] = (i < DIM2) ? weight_matrix[i * DIM1 + j] : static_cast<TYPE>(0);
+                        }
+                    }
+                }
+                packed_version = version;
+            }
+
+            // Threads an INFER_BLOCK batch runs on: the current pool and its caller when for_panels splits it, one otherwise
+            static std::size_t kernel_threads()
+            {
+                if (PANELS < 2 || INFER_BLOCK * DIM1 * DIM2 < detail::PARALLEL_WORK)
+                    return 1;
+
+                return current_pool().size() + 1;
+            }
+
+            // The winner depends on how many threads share the panels, so they are part of the key
+            static std::string kernel_key()
+            {
+                return tuning_key("dense_batch", {sizeof(TYPE), DIM1, DIM2, INFER_BLOCK, kernel_threads()});
+            }
+
+            // Pick kernel_tile from the tuning cache for the current pool, or benchmark the candidates if enabled
+            // and not cached yet
+            constexpr void select_kernel()
+            {
+                if (std::is_constant_evaluated())
+                    return;
+
+                if (auto tile = tuning_cache().find(kernel_key()))
+                    kernel_tile = *tile;
+                else if (tuning_cache().autotune_on_miss)
+                    tune(*this);
+            }
+
+            // Rebuild weight_matrix from packed_weights
+            constexpr void unpack() noexcept
+            {
+                for (std::size_t i = 0; i < DIM2; ++i)
+                {
+                    for (std::size_t j = 0; j < DIM1; ++j)
+                    {
+                        weight_matrix[i * DIM1 + j] = packed_weights[((i / PANEL) * DIM1 + j) * PANEL + i % PANEL];
+                    }
+                }
             }
 
     };
 
-    // Processing
+    // Call edit(weight_matrix) and repack. The reference is only valid during the call; the layer counts as
+    // changed from the start, so if edit throws, apply() repacks and inference reads weight_matrix directly.
+    template <typename TYPE, std::size_t DIM1, std::size_t DIM2, std::size_t BATCH, typename EDIT>
+    void edit_weights(Dense<TYPE, DIM1, DIM2, BATCH>& dense, EDIT&& edit)
+    {
+        ++dense.version;
+        edit(dense.weight_matrix);
+        dense.pack();
+    }
+
+    // Call after writing through spans kept from a parameters() visit (averaging replicas, ...) to repack the weights
+    template <typename TYPE, std::size_t DIM1, std::size_t DIM2, std::size_t BATCH>
+    void refresh(Dense<TYPE, DIM1, DIM2, BATCH>& dense) noexcept
+    {
+        ++dense.version;
+        dense.pack();
+    }
+
+    namespace detail
+    {
+        // Run body(first_panel, last_panel) over all panels of the layer, split across the current pool
+        // when `samples` samples make it worth it
+        template <typename TYPE, std::size_t DIM1, std::size_t DIM2, std::size_t BATCH, typename BODY>
+        void for_panels(const Dense<TYPE, DIM1, DIM2, BATCH>&, std::size_t samples, BODY&& body)
+        {
+            constexpr std::size_t PANELS = Dense<TYPE, DIM1, DIM2, BATCH>::PANELS;
+
+            if (PANELS < 2 || samples * DIM1 * DIM2 < PARALLEL_WORK)
+                body(0, PANELS);
+            else
+                parallel_for(current_pool(), 0, PANELS, 0, body);
+        }
+
+        // out = bias + W * in, over the packed panels [p_begin, p_end)
+        template <typename TYPE, std::size_t DIM1, std::size_t DIM2, std::size_t BATCH>
+        void dense_kernel(const Dense<TYPE, DIM1, DIM2, BATCH>& dense, const TYPE* in_vector, TYPE* out_vector,
+            std::size_t p_begin, std::size_t p_end) noexcept
+        {
+            constexpr std::size_t PANEL = Dense<TYPE, DIM1, DIM2, BATCH>::PANEL;
+
+            for (std::size_t p = p_begin; p < p_end; ++p)
+            {
+                std::array<TYPE, PANEL> acc{};
+                const TYPE* panel = dense.packed_weights.data() + p * DIM1 * PANEL;
+
+                for (std::size_t j = 0; j < DIM1; ++j)
+                {
+                    const TYPE x = in_vector[j];
+                    for (std::size_t r = 0; r < PANEL; ++r)
+                    {
+                        acc[r] += x * panel[j * PANEL + r];
+                    }
+                }
+
+                const std::size_t rows = std::min(PANEL, DIM2 - p * PANEL);
+                for (std::size_t r = 0; r < rows; ++r)
+                {
+                    out_vector[p * PANEL + r] = dense.bias_vector[p * PANEL + r] + acc[r];
+                }
+            }
+        }
+
+        // out = bias + W * in for N samples over the panels [p_begin, p_end);
+        // each panel is loaded once for a tile of up to TILE samples
+        template <std::size_t N, std::size_t TILE = 4, typename TYPE, std::size_t DIM1, std::size_t DIM2, std::size_t BATCH>
+        void dense_kernel_batch(const Dense<TYPE, DIM1, DIM2, BATCH>& dense, const TYPE* in_batch, TYPE* out_batch,
+            std::size_t p_begin, std::size_t p_end) noexcept
+        {
+            constexpr std::size_t PANEL = Dense<TYPE, DIM1, DIM2, BATCH>::PANEL;
+
+            for (std::size_t s0 = 0; s0 < N; s0 += TILE)
+            {
+                const std::size_t samples = std::min(TILE, N - s0);
+
+                for (std::size_t p = p_begin; p < p_end; ++p)
+                {
+                    std::array<std::array<TYPE, PANEL>, TILE> acc{};
+                    const TYPE* panel = dense.packed_weights.data() + p * DIM1 * PANEL;
+
+                    for (std::size_t j = 0; j < DIM1; ++j)
+                    {
+                        for (std::size_t s = 0; s < samples; ++s)
+                        {
+                            const TYPE x = in_batch[(s0 + s) * DIM1 + j];
+                            for (std::size_t r = 0; r < PANEL; ++r)
+                            {
+                                acc[s][r] += x * panel[j * PANEL + r];
+                            }
+                        }
+                    }
+
+                    const std::size_t rows = std::min(PANEL, DIM2 - p * PANEL);
+                    for (std::size_t s = 0; s < samples; ++s)
+                    {
+                        for (std::size_t r = 0; r < rows; ++r)
+                        {
+                            out_batch[(s0 + s) * DIM2 + p * PANEL + r] = dense.bias_vector[p * PANEL + r] + acc[s][r];
+                        }
+                    }
+                }
+            }
+        }
+
+        // dense_kernel_batch with the tile size chosen at run time
+        template <std::size_t N, typename TYPE, std::size_t DIM1, std::size_t DIM2, std::size_t BATCH>
+        void dense_kernel_batch_tuned(const Dense<TYPE, DIM1, DIM2, BATCH>& dense, std::size_t tile, const TYPE* in_batch, TYPE* out_batch,
+            std::size_t p_begin = 0, std::size_t p_end = Dense<TYPE, DIM1, DIM2, BATCH>::PANELS) noexcept
+        {
+            switch (tile)
+            {
+                case 1: dense_kernel_batch<N, 1>(dense, in_batch, out_batch, p_begin, p_end); break;
+                case 2: dense_kernel_batch<N, 2>(dense, in_batch, out_batch, p_begin, p_end); break;
+                case 8: dense_kernel_batch<N, 8>(dense, in_batch, out_batch, p_begin, p_end); break;
+                default: dense_kernel_batch<N, 4>(dense, in_batch, out_batch, p_begin, p_end); break;
+            }
+        }
+
+        // out = bias + W * in for N samples straight from weight_matrix, for when packed_weights is out of date
+        template <std::size_t N, typename TYPE, std::size_t DIM1, std::size_t DIM2, std::size_t BATCH>
+        void dense_kernel_unpacked(const Dense<TYPE, DIM1, DIM2, BATCH>& dense, const TYPE* in_batch, TYPE* out_batch) noexcept
+        {
+            const TYPE* weights = dense.weights().data();
+
+            for (std::size_t s = 0; s < N; ++s)
+            {
+                for (std::size_t i = 0; i < DIM2; ++i)
+                {
+                    TYPE acc = dense.bias_vector[i];
+                    for (std::size_t j = 0; j < DIM1; ++j)
+                    {
+                        acc += weights[i * DIM1 + j] * in_batch[s * DIM1 + j];
+                    }
+                    out_batch[s * DIM2 + i] = acc;
+                }
+            }
+        }
+    }
+
+    // Inference, leaves the layer untouched so it can run from several threads at once.
+    // Uses the packed weights when they are current, which holds after construction, apply, step and refresh,
+    // and falls back to a slower kernel on weight_matrix otherwise.
+    // Large layers split the panels across the current pool, so this can throw whatever parallel_for throws.
     template<typename TYPE, std::size_t DIM1, std::size_t DIM2, std::size_t BATCH>
-    std::array<TYPE, DIM2> apply(const Dense<TYPE, DIM1, DIM2, BATCH>& dense, const std::array<TYPE, DIM1>& in_vector) noexcept
+    std::array<TYPE, DIM2> infer(const Dense<TYPE, DIM1, DIM2, BATCH>& dense, const std::array<TYPE, DIM1>& in_vector)
     {
         std::array<TYPE, DIM2> out_vector;
+        if (dense.packed_version != dense.version)
+        {
+            detail::dense_kernel_unpacked<1>(dense, in_vector.data(), out_vector.data());
+            return out_vector;
+        }
 
-        for (std::size_t i = 0; i < DIM2; ++i)
+        detail::for_panels(dense, 1, [&](std::size_t p_begin, std::size_t p_end)
+        {
+            detail::dense_kernel(dense, in_vector.data(), out_vector.data(), p_begin, p_end);
+        });
+
+        return out_vector;
+    }
+
+    // Inference on N samples stored one after the other
+    template<std::size_t N, typename TYPE, std::size_t DIM1, std::size_t DIM2, std::size_t BATCH>
+    std::array<TYPE, DIM2*N> infer_batch(const Dense<TYPE, DIM1, DIM2, BATCH>& dense, const std::array<TYPE, DIM1*N>& in_batch)
+    {
+        std::array<TYPE, DIM2*N> out_batch;
+        if (dense.packed_version != dense.version)
         {
-            out_vector[i] = dense.bias_vector[i];
-            
-            for (std::size_t j = 0; j < DIM1; ++j)
+            detail::dense_kernel_unpacked<N>(dense, in_batch.data(), out_batch.data());
+            return out_batch;
+        }
+
+        detail::for_panels(dense, N, [&](std::size_t p_begin, std::size_t p_end)
+        {
+            detail::dense_kernel_batch_tuned<N>(dense, dense.kernel_tile, in_batch.data(), out_batch.data(), p_begin, p_end);
+        });
+
+        return out_batch;
+    }
+
+    // Benchmark the tile sizes of the batched kernel for this shape, store the fastest in the tuning cache and use it.
+    // Times infer_batch<INFER_BLOCK> itself, so the panels are split across the current pool as they are in evaluate(),
+    // and stores the winner under that pool's thread count.
+    template<typename TYPE, std::size_t DIM1, std::size_t DIM2, std::size_t BATCH>
+    std::size_t tune(Dense<TYPE, DIM1, DIM2, BATCH>& dense)
+    {
+        static constexpr std::array<std::size_t, 4> candidates = {1, 2, 4, 8};
+
+        if (dense.packed_version != dense.version)
+            dense.pack();
+
+        auto in_batch = std::make_unique<std::array<TYPE, DIM1*INFER_BLOCK>>();
+        in_batch->fill(static_cast<TYPE>(0.5));
+        volatile TYPE sink = 0;
+
+        dense.kernel_tile = autotune(Dense<TYPE, DIM1, DIM2, BATCH>::kernel_key(), candidates, [&](std::size_t tile)
+        {
+            dense.kernel_tile = tile;
+            for (std::size_t r = 0; r < 32; ++r)
             {
-                out_vector[i] += in_vector[j] * dense.weight_matrix[i * DIM1 + j];
-                
-                if constexpr (BATCH > 1)
-                    dense.mean_output_vector[i] = (dense.mean_output_vector[i]+out_vector[i]) / static_cast<TYPE>(2);
-                else
-                    dense.mean_output_vector[i] = out_vector[i];
+                sink = sink + infer_batch<INFER_BLOCK>(std::as_const(dense), *in_batch)[0];
             }
+        });
+
+        return dense.kernel_tile;
+    }
+
+    // Processing
+    template<typename TYPE, std::size_t DIM1, std::size_t DIM2, std::size_t BATCH>
+    std::array<TYPE, DIM2> apply(Dense<TYPE, DIM1, DIM2, BATCH>& dense, const std::array<TYPE, DIM1>& in_vector)
+    {
+        std::array<TYPE, DIM2> out_vector;
+
+        // Only repacks if the weights were written since the last refresh
+        if (dense.packed_version != dense.version)
+            dense.pack();
+
+        detail::for_panels(dense, 1, [&](std::size_t p_begin, std::size_t p_end)
+        {
+            detail::dense_kernel(dense, in_vector.data(), out_vector.data(), p_begin, p_end);
+        });
+
+        for (std::size_t i = 0; i < DIM2; ++i)
+        {
+            if constexpr (BATCH > 1)
+                dense.mean_output_vector[i] = (dense.mean_output_vector[i]+out_vector[i]) / static_cast<TYPE>(2);
+            else
+                dense.mean_output_vector[i] = out_vector[i];
         }
-        
+
         return out_vector;
     }
 
-    // Backpropagation
+    // Backpropagation: store the gradients of the parameters and return the gradient of the input,
+    // the parameters are left untouched until step()
     template <typename TYPE, std::size_t DIM1, std::size_t DIM2, std::size_t BATCH>
-    std::array<TYPE, DIM1> update(Dense<TYPE, DIM1, DIM2, BATCH>& dense, const std::array<TYPE, DIM2>& in_gradient) noexcept
+    std::array<TYPE, DIM1> backprop(Dense<TYPE, DIM1, DIM2, BATCH>& dense, const std::array<TYPE, DIM2>& in_gradient) noexcept
     {
-        //std::array<TYPE, DIM1> out_gradient;
+        std::array<TYPE, DIM1> out_gradient{};
+        const std::array<TYPE, DIM1*DIM2>& weights = dense.weights();
+
+        for (std::size_t i = 0; i < DIM2; ++i) {
+            const TYPE* row = weights.data() + i * DIM1;
 
-        // Update weight_matrix
-        for (std::size_t i = 0; i < DIM1; ++i) {
-            for (std::size_t j = 0; j < DIM2; ++j) {
-                dense.weight_matrix[j * DIM1 + i] -= dense.learning_rate * in_gradient[j] * dense.mean_output_vector[j];
+            for (std::size_t j = 0; j < DIM1; ++j) {
+                out_gradient[j] += row[j] * in_gradient[i];
             }
+            dense.weight_gradient[i] = in_gradient[i] * dense.mean_output_vector[i];
+            dense.bias_gradient[i] = in_gradient[i];
         }
 
+        return out_gradient;
+    }
+
+    // Apply the gradients of the last backprop()
+    template <typename TYPE, std::size_t DIM1, std::size_t DIM2, std::size_t BATCH>
+    void step(Dense<TYPE, DIM1, DIM2, BATCH>& dense) noexcept
+    {
+        edit_weights(dense, [&](std::array<TYPE, DIM1*DIM2>& weights)
+        {
+            for (std::size_t i = 0; i < DIM2; ++i) {
+                const TYPE shift = dense.learning_rate * dense.weight_gradient[i];
+                TYPE* row = weights.data() + i * DIM1;
+
+                for (std::size_t j = 0; j < DIM1; ++j) {
+                    row[j] -= shift;
+                }
+            }
+        });
+
         // Update bias_vector
         for (std::size_t i = 0; i < DIM2; ++i) {
-            dense.bias_vector[i] -= dense.learning_rate * in_gradient[i];
+            dense.bias_vector[i] -= dense.learning_rate * dense.bias_gradient[i];
         }
+    }
+
+    template <typename TYPE, std::size_t DIM1, std::size_t DIM2, std::size_t BATCH>
+    std::array<TYPE, DIM1> update(Dense<TYPE, DIM1, DIM2, BATCH>& dense, const std::array<TYPE, DIM2>& in_gradient) noexcept
+    {
+        std::array<TYPE, DIM1> out_gradient = backprop(dense, in_gradient);
+        step(dense);
 
         return out_gradient;
     }
 
+    // Trainable parameters, visited in a fixed order so that every replica of the layer sees the same layout.
+    // The weights are visited inside edit_weights(): writes made during the visit are repacked, a span kept
+    // for later writes needs a refresh() after them.
+    template <typename TYPE, std::size_t DIM1, std::size_t DIM2, std::size_t BATCH>
+    void parameters(Dense<TYPE, DIM1, DIM2, BATCH>& dense, auto&& visit)
+    {
+        edit_weights(dense, [&](std::array<TYPE, DIM1*DIM2>& weights){ visit(std::span<TYPE>{weights}); });
+        visit(std::span<TYPE>{dense.bias_vector});
+    }
+
+    // Gradients of the last backprop(), in the same order as the parameters; step() applies what is left in them
+    template <typename TYPE, std::size_t DIM1, std::size_t DIM2, std::size_t BATCH>
+    void gradients(Dense<TYPE, DIM1, DIM2, BATCH>& dense, auto&& visit)
+    {
+        visit(std::span<TYPE>{dense.weight_gradient});
+        visit(std::span<TYPE>{dense.bias_gradient});
+    }
 
 }
 
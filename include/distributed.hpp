@@ -0,0 +1,908 @@
+#ifndef _DISTRIBUTED_H
+#define _DISTRIBUTED_H
+
+#include <neuralnet.hpp>
+#include <array>
+#include <span>
+#include <vector>
+#include <deque>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <algorithm>
+#include <cstring>
+#include <cstdint>
+#include <cerrno>
+#include <cassert>
+#include <new>
+#include <utility>
+#include <exception>
+#include <string>
+#include <system_error>
+#include <chrono>
+#include <limits>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+namespace nn
+{
+    // Data-parallel training across processes.
+    //
+    // A transport only has to provide rank(), world() and
+    //     void exchange(std::size_t send_peer, const void* send_buf, std::size_t send_bytes,
+    //                   std::size_t recv_peer, void* recv_buf, std::size_t recv_bytes);
+    // which sends and receives at the same time (either side may be empty), so that a ring of
+    // processes all sending to their right neighbour cannot deadlock on full buffers.
+
+    typedef enum
+    {
+        RING,
+        RECURSIVE_HALVING
+    } allreduce_t;
+
+    namespace detail
+    {
+        [[noreturn]] inline void throw_errno(const char* what)
+        {
+            throw std::system_error(errno, std::generic_category(), what);
+        }
+
+        // Waiting for the other ranks: yield for a while, then sleep for exponentially longer (up to max_sleep),
+        // and give up with ETIMEDOUT once the deadline has passed
+        struct PeerWait
+        {
+            public:
+
+                explicit PeerWait(std::chrono::milliseconds timeout, std::chrono::microseconds max_sleep = std::chrono::milliseconds{10}) :
+                    timeout{timeout},
+                    max_sleep{max_sleep},
+                    deadline{std::chrono::steady_clock::now() + timeout}
+                {}
+
+                void operator()(const char* what)
+                {
+                    if (std::chrono::steady_clock::now() >= deadline)
+                        throw std::system_error(ETIMEDOUT, std::generic_category(), what);
+
+                    if (attempt < 64)
+                        std::this_thread::yield();
+                    else
+                        std::this_thread::sleep_for(std::min(max_sleep, std::chrono::microseconds{std::int64_t{1} << std::min<std::size_t>(attempt - 64, 20)}));
+                    ++attempt;
+                }
+
+                // The peers made progress: start over with a full timeout
+                void reset() noexcept
+                {
+                    deadline = std::chrono::steady_clock::now() + timeout;
+                    attempt = 0;
+                }
+
+                // Milliseconds left before the deadline, for poll()
+                int remaining() const noexcept
+                {
+                    const auto left = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now());
+                    return static_cast<int>(std::clamp<std::chrono::milliseconds::rep>(left.count(), 0, std::numeric_limits<int>::max()));
+                }
+
+            private:
+
+                std::chrono::milliseconds timeout;
+                std::chrono::microseconds max_sleep;
+                std::chrono::steady_clock::time_point deadline;
+                std::size_t attempt = 0;
+        };
+
+        // Owns a file descriptor, so that a constructor that throws half way does not leak its sockets
+        struct FileDescriptor
+        {
+            public:
+
+                explicit FileDescriptor(int fd = -1) noexcept : fd{fd}
+                {}
+
+                FileDescriptor(FileDescriptor&& other) noexcept : fd{std::exchange(other.fd, -1)}
+                {}
+
+                FileDescriptor& operator=(FileDescriptor&& other) noexcept
+                {
+                    if (this != &other)
+                    {
+                        if (fd >= 0) close(fd);
+                        fd = std::exchange(other.fd, -1);
+                    }
+                    return *this;
+                }
+
+                ~FileDescriptor()
+                {
+                    if (fd >= 0) close(fd);
+                }
+
+                int get() const noexcept { return fd; }
+
+            private:
+
+                int fd;
+        };
+    }
+
+    // POSIX shared memory transport: one single-producer single-consumer byte ring per ordered pair of ranks.
+    // Rank 0 creates the segment named `name`, replacing any segment a crashed run left behind, and removes it
+    // on destruction; the other ranks attach to it. All the ranks of a run must pass the same `run_id`, unique to
+    // the run (a job id, the launcher's pid, ...): rank 0 stamps it into the segment and the others only attach
+    // to a segment that carries it, so they never join a stale one. Setup throws ETIMEDOUT if the ranks do not
+    // meet within `timeout`, and so does exchange() when its peers make no progress for that long.
+    struct ShmTransport
+    {
+        public:
+
+            ShmTransport(const std::string& name, std::size_t rank, std::size_t world, std::uint64_t run_id,
+                std::size_t channel_bytes = 1 << 20, std::chrono::milliseconds timeout = std::chrono::seconds{60}) :
+                name{name},
+                rank_{rank},
+                world_{world},
+                capacity{channel_bytes},
+                timeout{timeout}
+            {
+                static_assert(std::atomic<std::size_t>::is_always_lock_free);
+                assert(rank < world && channel_bytes > 0);
+
+                segment_bytes = header_stride() + world * world * channel_stride();
+
+                if (rank == 0)
+                {
+                    // Ranks still attached to a stale segment keep their mapping but will not find run_id in it
+                    shm_unlink(name.c_str());
+                    const int fd = shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+                    if (fd < 0) detail::throw_errno("shm_open");
+                    if (ftruncate(fd, static_cast<off_t>(segment_bytes)) < 0)
+                    {
+                        close(fd);
+                        detail::throw_errno("ftruncate");
+                    }
+                    map(fd);
+
+                    for (std::size_t i = 0; i < world * world; ++i)
+                    {
+                        new (channel(i)) Channel{};
+                    }
+                    new (base) Header{};
+                    header()->run_id.store(run_id, std::memory_order_relaxed);
+                    header()->ready.store(MAGIC, std::memory_order_release);
+                    return;
+                }
+
+                // Wait for rank 0 to create, size and stamp the segment, reopening it every time in case
+                // the one we found is stale and gets replaced
+                detail::PeerWait wait{timeout};
+                for (;; wait("shm_open"))
+                {
+                    const int fd = shm_open(name.c_str(), O_RDWR, 0600);
+                    if (fd < 0)
+                    {
+                        if (errno != ENOENT) detail::throw_errno("shm_open");
+                        continue;
+                    }
+
+                    struct stat st{};
+                    if (fstat(fd, &st) < 0 || static_cast<std::size_t>(st.st_size) < segment_bytes)
+                    {
+                        close(fd);
+                        continue;
+                    }
+                    map(fd);
+
+                    if (header()->ready.load(std::memory_order_acquire) == MAGIC &&
+                        header()->run_id.load(std::memory_order_relaxed) == run_id)
+                        return;
+
+                    munmap(base, segment_bytes);
+                    base = nullptr;
+                }
+            }
+
+            ShmTransport(const ShmTransport&) = delete;
+            ShmTransport& operator=(const ShmTransport&) = delete;
+
+            ~ShmTransport()
+            {
+                munmap(base, segment_bytes);
+                if (rank_ == 0) shm_unlink(name.c_str());
+            }
+
+            std::size_t rank() const noexcept { return rank_; }
+            std::size_t world() const noexcept { return world_; }
+
+            void exchange(std::size_t send_peer, const void* send_buf, std::size_t send_bytes,
+                std::size_t recv_peer, void* recv_buf, std::size_t recv_bytes)
+            {
+                Channel* out = channel(rank_ * world_ + send_peer);
+                Channel* in = channel(recv_peer * world_ + rank_);
+                std::uint8_t* out_data = data(out);
+                std::uint8_t* in_data = data(in);
+                const std::uint8_t* src = static_cast<const std::uint8_t*>(send_buf);
+                std::uint8_t* dst = static_cast<std::uint8_t*>(recv_buf);
+
+                std::size_t sent = 0, received = 0;
+                detail::PeerWait wait{timeout, std::chrono::microseconds{100}};
+                while (sent < send_bytes || received < recv_bytes)
+                {
+                    bool progress = false;
+
+                    if (sent < send_bytes)
+                    {
+                        const std::size_t head = out->head.load(std::memory_order_relaxed);
+                        const std::size_t tail = out->tail.load(std::memory_order_acquire);
+                        std::size_t n = std::min(send_bytes - sent, capacity - (head - tail));
+                        for (std::size_t done = 0; done < n; )
+                        {
+                            const std::size_t offset = (head + done) % capacity;
+                            const std::size_t run = std::min(n - done, capacity - offset);
+                            std::memcpy(out_data + offset, src + sent + done, run);
+                            done += run;
+                        }
+                        out->head.store(head + n, std::memory_order_release);
+                        sent += n;
+                        progress |= n > 0;
+                    }
+
+                    if (received < recv_bytes)
+                    {
+                        const std::size_t tail = in->tail.load(std::memory_order_relaxed);
+                        const std::size_t head = in->head.load(std::memory_order_acquire);
+                        std::size_t n = std::min(recv_bytes - received, head - tail);
+                        for (std::size_t done = 0; done < n; )
+                        {
+                            const std::size_t offset = (tail + done) % capacity;
+                            const std::size_t run = std::min(n - done, capacity - offset);
+                            std::memcpy(dst + received + done, in_data + offset, run);
+                            done += run;
+                        }
+                        in->tail.store(tail + n, std::memory_order_release);
+                        received += n;
+                        progress |= n > 0;
+                    }
+
+                    if (progress)
+                        wait.reset();
+                    else
+                        wait("exchange");
+                }
+            }
+
+        private:
+
+            static constexpr std::uint64_t MAGIC = 0x6e6e2d73686d3031ULL;
+
+            struct Header
+            {
+                std::atomic<std::uint64_t> ready{0};
+                std::atomic<std::uint64_t> run_id{0};
+            };
+
+            // head and tail live on separate cache lines so producer and consumer do not false-share
+            struct Channel
+            {
+                alignas(64) std::atomic<std::size_t> head{0};
+                alignas(64) std::atomic<std::size_t> tail{0};
+            };
+
+            std::string name;
+            std::size_t rank_;
+            std::size_t world_;
+            std::size_t capacity;
+            std::chrono::milliseconds timeout;
+            std::size_t segment_bytes;
+            std::uint8_t* base = nullptr;
+
+            std::size_t channel_stride() const noexcept
+            {
+                return (sizeof(Channel) + capacity + 63) / 64 * 64;
+            }
+
+            static constexpr std::size_t header_stride() noexcept
+            {
+                return (sizeof(Header) + 63) / 64 * 64;
+            }
+
+            // Map the segment behind fd and close it
+            void map(int fd)
+            {
+                void* ptr = mmap(nullptr, segment_bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+                close(fd);
+                if (ptr == MAP_FAILED) detail::throw_errno("mmap");
+                base = static_cast<std::uint8_t*>(ptr);
+            }
+
+            Header* header() const noexcept
+            {
+                return reinterpret_cast<Header*>(base);
+            }
+
+            Channel* channel(std::size_t index) const noexcept
+            {
+                return reinterpret_cast<Channel*>(base + header_stride() + index * channel_stride());
+            }
+
+            std::uint8_t* data(Channel* ch) const noexcept
+            {
+                return reinterpret_cast<std::uint8_t*>(ch) + sizeof(Channel);
+            }
+    };
+
+    // Localhost TCP transport: a full mesh of connections, rank r listens on base_port + r.
+    // Lower ranks accept, higher ranks connect, so setup cannot deadlock; it throws ETIMEDOUT if the ranks
+    // do not meet within `timeout`, and so does exchange() when its peers make no progress for that long.
+    struct TcpTransport
+    {
+        public:
+
+            TcpTransport(std::size_t rank, std::size_t world, std::uint16_t base_port, const char* host = "127.0.0.1",
+                std::chrono::milliseconds timeout = std::chrono::seconds{60}) :
+                rank_{rank},
+                world_{world},
+                timeout{timeout},
+                sockets(world)
+            {
+                assert(rank < world);
+
+                sockaddr_in addr{};
+                addr.sin_family = AF_INET;
+                if (inet_pton(AF_INET, host, &addr.sin_addr) != 1) detail::throw_errno("inet_pton");
+
+                detail::FileDescriptor listener;
+                if (rank + 1 < world)
+                {
+                    listener = detail::FileDescriptor{socket(AF_INET, SOCK_STREAM, 0)};
+                    if (listener.get() < 0) detail::throw_errno("socket");
+                    int one = 1;
+                    setsockopt(listener.get(), SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+                    addr.sin_port = htons(static_cast<std::uint16_t>(base_port + rank));
+                    if (bind(listener.get(), reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0) detail::throw_errno("bind");
+                    if (listen(listener.get(), static_cast<int>(world)) < 0) detail::throw_errno("listen");
+                }
+
+                // Connect to every lower rank, retrying until it listens, and introduce ourselves
+                detail::PeerWait wait{timeout};
+                for (std::size_t peer = 0; peer < rank; ++peer)
+                {
+                    addr.sin_port = htons(static_cast<std::uint16_t>(base_port + peer));
+                    detail::FileDescriptor fd;
+                    for (;; wait("connect"))
+                    {
+                        fd = detail::FileDescriptor{socket(AF_INET, SOCK_STREAM, 0)};
+                        if (fd.get() < 0) detail::throw_errno("socket");
+                        if (connect(fd.get(), reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == 0) break;
+                        if (errno != ECONNREFUSED && errno != EINTR) detail::throw_errno("connect");
+                    }
+                    std::uint64_t me = rank;
+                    write_all(fd.get(), &me, sizeof(me));
+                    sockets[peer] = std::move(fd);
+                }
+
+                // Accept every higher rank. Connections that do not introduce themselves in time as a rank
+                // still missing are strays: they are dropped and we keep accepting.
+                for (std::size_t n = rank + 1; n < world; )
+                {
+                    pollfd pending{listener.get(), POLLIN, 0};
+                    int ready;
+                    while ((ready = poll(&pending, 1, wait.remaining())) <= 0)
+                    {
+                        if (ready < 0 && errno != EINTR) detail::throw_errno("poll");
+                        wait("accept");
+                    }
+                    detail::FileDescriptor fd{accept(listener.get(), nullptr, nullptr)};
+                    if (fd.get() < 0)
+                    {
+                        if (errno == EINTR || errno == ECONNABORTED) continue;
+                        detail::throw_errno("accept");
+                    }
+
+                    const int left = std::max(wait.remaining(), 1);
+                    timeval patience{left / 1000, (left % 1000) * 1000};
+                    setsockopt(fd.get(), SOL_SOCKET, SO_RCVTIMEO, &patience, sizeof(patience));
+
+                    std::uint64_t peer;
+                    try
+                    {
+                        read_all(fd.get(), &peer, sizeof(peer));
+                    }
+                    catch (const std::system_error&)
+                    {
+                        continue;
+                    }
+                    if (peer <= rank || peer >= world || sockets[peer].get() >= 0) continue;
+
+                    sockets[peer] = std::move(fd);
+                    ++n;
+                }
+
+                for (const detail::FileDescriptor& fd : sockets)
+                {
+                    if (fd.get() < 0) continue;
+                    int one = 1;
+                    setsockopt(fd.get(), IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+                    fcntl(fd.get(), F_SETFL, fcntl(fd.get(), F_GETFL) | O_NONBLOCK);
+                }
+            }
+
+            TcpTransport(const TcpTransport&) = delete;
+            TcpTransport& operator=(const TcpTransport&) = delete;
+
+            std::size_t rank() const noexcept { return rank_; }
+            std::size_t world() const noexcept { return world_; }
+
+            void exchange(std::size_t send_peer, const void* send_buf, std::size_t send_bytes,
+                std::size_t recv_peer, void* recv_buf, std::size_t recv_bytes)
+            {
+                const std::uint8_t* src = static_cast<const std::uint8_t*>(send_buf);
+                std::uint8_t* dst = static_cast<std::uint8_t*>(recv_buf);
+                std::size_t sent = 0, received = 0;
+
+                while (sent < send_bytes || received < recv_bytes)
+                {
+                    std::array<pollfd, 2> fds{};
+                    nfds_t count = 0;
+                    if (sent < send_bytes) fds[count++] = {sockets[send_peer].get(), POLLOUT, 0};
+                    if (received < recv_bytes)
+                    {
+                        if (count == 1 && send_peer == recv_peer) fds[0].events |= POLLIN;
+                        else fds[count++] = {sockets[recv_peer].get(), POLLIN, 0};
+                    }
+
+                    const int ready = poll(fds.data(), count, static_cast<int>(std::min<std::chrono::milliseconds::rep>(timeout.count(), std::numeric_limits<int>::max())));
+                    if (ready == 0) throw std::system_error(ETIMEDOUT, std::generic_category(), "exchange");
+                    if (ready < 0)
+                    {
+                        if (errno == EINTR) continue;
+                        detail::throw_errno("poll");
+                    }
+
+                    if (sent < send_bytes)
+                    {
+                        ssize_t n = send(sockets[send_peer].get(), src + sent, send_bytes - sent, MSG_NOSIGNAL);
+                        if (n > 0) sent += static_cast<std::size_t>(n);
+                        else if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) detail::throw_errno("send");
+                    }
+
+                    if (received < recv_bytes)
+                    {
+                        ssize_t n = recv(sockets[recv_peer].get(), dst + received, recv_bytes - received, 0);
+                        if (n > 0) received += static_cast<std::size_t>(n);
+                        else if (n == 0) throw std::system_error(ECONNRESET, std::generic_category(), "recv");
+                        else if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) detail::throw_errno("recv");
+                    }
+                }
+            }
+
+        private:
+
+            std::size_t rank_;
+            std::size_t world_;
+            std::chrono::milliseconds timeout;
+            std::vector<detail::FileDescriptor> sockets;
+
+            // Blocking helpers, only used during setup
+            static void write_all(int fd, const void* buf, std::size_t bytes)
+            {
+                const std::uint8_t* p = static_cast<const std::uint8_t*>(buf);
+                while (bytes > 0)
+                {
+                    ssize_t n = write(fd, p, bytes);
+                    if (n < 0 && errno == EINTR) continue;
+                    if (n <= 0) detail::throw_errno("write");
+                    p += n; bytes -= static_cast<std::size_t>(n);
+                }
+            }
+
+            static void read_all(int fd, void* buf, std::size_t bytes)
+            {
+                std::uint8_t* p = static_cast<std::uint8_t*>(buf);
+                while (bytes > 0)
+                {
+                    ssize_t n = read(fd, p, bytes);
+                    if (n < 0 && errno == EINTR) continue;
+                    if (n <= 0) detail::throw_errno("read");
+                    p += n; bytes -= static_cast<std::size_t>(n);
+                }
+            }
+    };
+
+    // Sum `values` element-wise across all ranks of the transport, in place.
+    // RING works for any world size; RECURSIVE_HALVING (reduce-scatter by halving, all-gather by doubling)
+    // needs log2(world) steps instead of world-1 and falls back to RING when world is not a power of two.
+    template <allreduce_t MODE = RING, typename TYPE, typename TRANSPORT>
+    void allreduce(TRANSPORT& transport, std::span<TYPE> values)
+    {
+        const std::size_t world = transport.world();
+        const std::size_t rank = transport.rank();
+        const std::size_t n = values.size();
+        if (world == 1 || n == 0) return;
+
+        // Receive buffer for the partial sums of one segment, borrowed from the scratch arena of the calling thread
+        const bool halving = MODE == RECURSIVE_HALVING && (world & (world - 1)) == 0;
+        const std::span<std::byte> arena = current_pool().scratch((halving ? n / 2 + 1 : n / world + 1) * sizeof(TYPE));
+        TYPE* const scratch = reinterpret_cast<TYPE*>(arena.data());
+
+        if (halving)
+        {
+
+            // Reduce-scatter: each step halves the range we are responsible for
+            struct Step { std::size_t lo, hi; bool keep_low; };
+            std::vector<Step> steps;
+            std::size_t lo = 0, hi = n;
+            for (std::size_t distance = world / 2; distance > 0; distance /= 2)
+            {
+                const std::size_t peer = rank ^ distance;
+                const std::size_t mid = lo + (hi - lo) / 2;
+                const bool keep_low = (rank & distance) == 0;
+                const std::size_t send_lo = keep_low ? mid : lo, send_hi = keep_low ? hi : mid;
+                const std::size_t keep_lo = keep_low ? lo : mid, keep_hi = keep_low ? mid : hi;
+
+                transport.exchange(peer, values.data() + send_lo, (send_hi - send_lo) * sizeof(TYPE),
+                    peer, scratch, (keep_hi - keep_lo) * sizeof(TYPE));
+                for (std::size_t i = keep_lo; i < keep_hi; ++i)
+                {
+                    values[i] += scratch[i - keep_lo];
+                }
+
+                steps.push_back({lo, hi, keep_low});
+                lo = keep_lo; hi = keep_hi;
+            }
+
+            // All-gather: replay the steps backwards, swapping the reduced halves
+            for (std::size_t distance = 1; distance < world; distance *= 2)
+            {
+                const std::size_t peer = rank ^ distance;
+                const Step outer = steps.back();
+                steps.pop_back();
+                const std::size_t other_lo = outer.keep_low ? hi : outer.lo;
+                const std::size_t other_hi = outer.keep_low ? outer.hi : lo;
+
+                transport.exchange(peer, values.data() + lo, (hi - lo) * sizeof(TYPE),
+                    peer, values.data() + other_lo, (other_hi - other_lo) * sizeof(TYPE));
+
+                lo = outer.lo; hi = outer.hi;
+            }
+
+            return;
+        }
+
+        // Ring: world-1 reduce-scatter steps followed by world-1 all-gather steps over world segments
+        const std::size_t right = (rank + 1) % world;
+        const std::size_t left = (rank + world - 1) % world;
+        auto segment_begin = [&](std::size_t s){ return (n * s) / world; };
+        auto segment_size = [&](std::size_t s){ return segment_begin(s + 1) - segment_begin(s); };
+
+        for (std::size_t step = 0; step + 1 < world; ++step)
+        {
+            const std::size_t send_segment = (rank + world - step) % world;
+            const std::size_t recv_segment = (rank + world - step - 1) % world;
+
+            transport.exchange(right, values.data() + segment_begin(send_segment), segment_size(send_segment) * sizeof(TYPE),
+                left, scratch, segment_size(recv_segment) * sizeof(TYPE));
+
+            TYPE* target = values.data() + segment_begin(recv_segment);
+            for (std::size_t i = 0; i < segment_size(recv_segment); ++i)
+            {
+                target[i] += scratch[i];
+            }
+        }
+
+        for (std::size_t step = 0; step + 1 < world; ++step)
+        {
+            const std::size_t send_segment = (rank + 1 + world - step) % world;
+            const std::size_t recv_segment = (rank + world - step) % world;
+
+            transport.exchange(right, values.data() + segment_begin(send_segment), segment_size(send_segment) * sizeof(TYPE),
+                left, values.data() + segment_begin(recv_segment), segment_size(recv_segment) * sizeof(TYPE));
+        }
+    }
+
+    // Copy `values` of rank 0 to every other rank, passed along the ring
+    template <typename TYPE, typename TRANSPORT>
+    void broadcast(TRANSPORT& transport, std::span<TYPE> values)
+    {
+        const std::size_t world = transport.world();
+        const std::size_t rank = transport.rank();
+        const std::size_t bytes = values.size() * sizeof(TYPE);
+        if (world == 1) return;
+
+        if (rank > 0)
+        {
+            transport.exchange(rank, nullptr, 0, rank - 1, values.data(), bytes);
+        }
+        if (rank + 1 < world)
+        {
+            transport.exchange(rank + 1, values.data(), bytes, rank, nullptr, 0);
+        }
+    }
+
+    // Concatenation of the `values` of every rank in rank order; the ranks may contribute different counts
+    template <typename TYPE, typename TRANSPORT>
+    std::vector<TYPE> allgather(TRANSPORT& transport, std::span<const TYPE> values)
+    {
+        const std::size_t world = transport.world();
+        const std::size_t rank = transport.rank();
+        const std::size_t right = (rank + 1) % world;
+        const std::size_t left = (rank + world - 1) % world;
+
+        // Pass every block once around the ring, first the counts, then the values
+        std::vector<std::uint64_t> counts(world, 0);
+        counts[rank] = values.size();
+        for (std::size_t step = 0; step + 1 < world; ++step)
+        {
+            const std::size_t send_block = (rank + world - step) % world;
+            const std::size_t recv_block = (rank + world - step - 1) % world;
+            transport.exchange(right, &counts[send_block], sizeof(std::uint64_t), left, &counts[recv_block], sizeof(std::uint64_t));
+        }
+
+        std::vector<std::size_t> offsets(world + 1, 0);
+        for (std::size_t r = 0; r < world; ++r)
+        {
+            offsets[r + 1] = offsets[r] + counts[r];
+        }
+
+        std::vector<TYPE> gathered(offsets[world]);
+        std::copy(values.begin(), values.end(), gathered.begin() + offsets[rank]);
+        for (std::size_t step = 0; step + 1 < world; ++step)
+        {
+            const std::size_t send_block = (rank + world - step) % world;
+            const std::size_t recv_block = (rank + world - step - 1) % world;
+            transport.exchange(right, gathered.data() + offsets[send_block], counts[send_block] * sizeof(TYPE),
+                left, gathered.data() + offsets[recv_block], counts[recv_block] * sizeof(TYPE));
+        }
+
+        return gathered;
+    }
+
+    // Averages values across ranks in buckets of about bucket_bytes, normally the gradients of the layers.
+    // Each full bucket is handed to a background thread as soon as it fills up, so its reduction overlaps with
+    // the backward pass of the earlier layers; synchronize() waits for the buckets and writes the averages back.
+    // Every rank has to enqueue the same number of values in the same order, which holds for replicas of one model.
+    template <typename TYPE, typename TRANSPORT, allreduce_t MODE = RING>
+    struct Communicator
+    {
+        public:
+
+            TRANSPORT& transport;
+            std::size_t bucket_bytes;
+
+            Communicator(TRANSPORT& transport, std::size_t bucket_bytes = 1 << 20) :
+                transport{transport},
+                bucket_bytes{bucket_bytes},
+                worker{[this]{ run(); }}
+            {}
+
+            Communicator(const Communicator&) = delete;
+            Communicator& operator=(const Communicator&) = delete;
+
+            ~Communicator()
+            {
+                {
+                    std::lock_guard lock{mutex};
+                    stopping = true;
+                }
+                pending_cv.notify_all();
+                worker.join();
+            }
+
+            std::size_t rank() const noexcept { return transport.rank(); }
+            std::size_t world() const noexcept { return transport.world(); }
+
+            // Queue `values` for averaging, they must stay untouched until synchronize()
+            void enqueue(std::span<TYPE> values)
+            {
+                filling.segments.push_back(values);
+                filling.values.insert(filling.values.end(), values.begin(), values.end());
+
+                if (filling.values.size() * sizeof(TYPE) >= bucket_bytes)
+                {
+                    flush();
+                }
+            }
+
+            // Queue the gradients of the last backprop() of `layer`
+            template <typename LAYER>
+            void enqueue_gradients(LAYER& layer)
+            {
+                gradients(layer, [this](std::span<TYPE> values){ enqueue(values); });
+            }
+
+            // Embedding gradients only cover the rows of the local batch. The ranks agree on the union of the rows
+            // with an all-gather of their ids, and every rank spreads its gradients onto that union, with zeros for
+            // the rows it did not touch, so that step() writes the same rows everywhere. The all-gather needs the
+            // transport, so the buckets queued so far are reduced first; the embedding is normally the first
+            // layer, whose gradients come last, so there is little left to overlap with anyway.
+            template <std::size_t VOCAB, std::size_t DIM, std::size_t BATCH, std::size_t BAG, pooling_t POOL>
+            void enqueue_gradients(Embedding<TYPE, VOCAB, DIM, BATCH, BAG, POOL>& embedding)
+            {
+                synchronize();
+
+                std::vector<std::size_t> rows = allgather(transport, std::span<const std::size_t>{embedding.updated});
+                std::sort(rows.begin(), rows.end());
+                rows.erase(std::unique(rows.begin(), rows.end()), rows.end());
+
+                // Both id lists are sorted, so the local rows are found in one pass
+                std::vector<TYPE> row_gradients(rows.size() * DIM, static_cast<TYPE>(0));
+                auto row = rows.begin();
+                for (std::size_t r = 0; r < embedding.updated.size(); ++r)
+                {
+                    row = std::lower_bound(row, rows.end(), embedding.updated[r]);
+                    const TYPE* local = embedding.row_gradients.data() + r * DIM;
+                    std::copy(local, local + DIM, row_gradients.begin() + (row - rows.begin()) * DIM);
+                }
+
+                embedding.updated = std::move(rows);
+                embedding.row_gradients = std::move(row_gradients);
+                enqueue(std::span<TYPE>{embedding.row_gradients});
+            }
+
+            // Wait for all queued buckets and copy the averages back into the enqueued spans
+            void synchronize()
+            {
+                flush();
+
+                std::unique_lock lock{mutex};
+                done_cv.wait(lock, [this]{ return in_flight == 0 || failure; });
+                if (failure) std::rethrow_exception(std::exchange(failure, nullptr));
+
+                const TYPE scale = static_cast<TYPE>(1) / static_cast<TYPE>(world());
+                for (Bucket& bucket : finished)
+                {
+                    auto value = bucket.values.begin();
+                    for (std::span<TYPE> segment : bucket.segments)
+                    {
+                        std::transform(value, value + segment.size(), segment.begin(), [=](TYPE v){ return v * scale; });
+                        value += segment.size();
+                    }
+                }
+                finished.clear();
+            }
+
+            // Make every rank start from the parameters of rank 0
+            template <typename LAYER>
+            void broadcast_layer(LAYER& layer)
+            {
+                parameters(layer, [this](std::span<TYPE> params){ nn::broadcast(transport, params); });
+            }
+
+            // Mean of a scalar across ranks, e.g. the loss
+            TYPE average(TYPE value)
+            {
+                synchronize();
+                nn::allreduce<MODE>(transport, std::span<TYPE>{&value, 1});
+
+                return value / static_cast<TYPE>(world());
+            }
+
+        private:
+
+            struct Bucket
+            {
+                std::vector<std::span<TYPE>> segments;
+                std::vector<TYPE> values;
+            };
+
+            Bucket filling;
+            std::deque<Bucket> pending;
+            std::vector<Bucket> finished;
+            std::size_t in_flight = 0;
+            std::exception_ptr failure;
+            bool stopping = false;
+            std::mutex mutex;
+            std::condition_variable pending_cv;
+            std::condition_variable done_cv;
+            std::thread worker;
+
+            void flush()
+            {
+                if (filling.segments.empty()) return;
+                {
+                    std::lock_guard lock{mutex};
+                    pending.push_back(std::move(filling));
+                    ++in_flight;
+                }
+                filling = Bucket{};
+                pending_cv.notify_one();
+            }
+
+            // Buckets are reduced in the order they were queued, which is the same on every rank
+            void run()
+            {
+                for (;;)
+                {
+                    Bucket bucket;
+                    {
+                        std::unique_lock lock{mutex};
+                        pending_cv.wait(lock, [this]{ return stopping || !pending.empty(); });
+                        if (pending.empty()) return;
+                        bucket = std::move(pending.front());
+                        pending.pop_front();
+                    }
+
+                    try
+                    {
+                        nn::allreduce<MODE>(transport, std::span<TYPE>{bucket.values});
+                    }
+                    catch (...)
+                    {
+                        std::lock_guard lock{mutex};
+                        failure = std::current_exception();
+                    }
+
+                    {
+                        std::lock_guard lock{mutex};
+                        finished.push_back(std::move(bucket));
+                        --in_flight;
+                    }
+                    done_cv.notify_all();
+                }
+            }
+    };
+
+    // Data-parallel variant of train: every process holds a replica of the layers and trains on its share of
+    // the batches (batch i goes to rank i % world). The gradients of each layer are averaged across ranks through
+    // the communicator as soon as its backprop() is done, and every rank then applies the same averaged gradients
+    // with step(), so the replicas stay identical without ever exchanging the parameters after the start.
+    // Batches that cannot be split evenly across the ranks are skipped. Returns the loss of the last step
+    // averaged across ranks.
+    template <std::size_t TRAIN_DIM,
+        std::size_t LABELS_DIM,
+        std::size_t DEPTH,
+        std::size_t BATCH,
+        typename TYPE,
+        losstype_t LOSS,
+        typename TRANSPORT,
+        allreduce_t MODE,
+        typename ... LAYERS>
+    TYPE train(const std::array<TYPE, TRAIN_DIM*DEPTH>& train_set,
+        const std::array<TYPE, LABELS_DIM*DEPTH>& labels_set,
+        const std::size_t epochs,
+        const Loss<LOSS, LABELS_DIM> loss,
+        Communicator<TYPE, TRANSPORT, MODE>& communicator,
+        LAYERS&... layers)
+    {
+        static_assert(DEPTH >= BATCH, "training set smaller than one batch");
+
+        const std::size_t world = communicator.world();
+        const std::size_t rank = communicator.rank();
+        const std::size_t steps = (DEPTH / BATCH) / world;
+
+        TYPE compounded_loss = 0;
+        auto on_gradients = [&](auto& layer){ communicator.enqueue_gradients(layer); };
+
+        // Replicas may have been initialised differently
+        (communicator.broadcast_layer(layers), ...);
+        (refresh(layers), ...);
+
+        for (std::size_t k = 0; k < epochs; ++k)
+        {
+            for (std::size_t step = 0; step < steps; ++step)
+            {
+                const std::size_t i = step * world + rank;
+                const TYPE* train_ptr = train_set.data() + i * TRAIN_DIM * BATCH;
+                const TYPE* labels_ptr = labels_set.data() + i * LABELS_DIM * BATCH;
+
+                compounded_loss = detail::train_batch<TRAIN_DIM, LABELS_DIM, BATCH>(train_ptr, labels_ptr, loss, on_gradients, layers...);
+                communicator.synchronize();
+                (nn::step(layers), ...);
+            }
+        }
+
+        return communicator.average(compounded_loss);
+    }
+}
+
+#endif
@@ -0,0 +1,268 @@
+#ifndef _EMBEDDING_H
+#define _EMBEDDING_H
+
+#include <array>
+#include <vector>
+#include <span>
+#include <cstddef>
+#include <cassert>
+#include <algorithm>
+#include <random>
+#include <utility>
+#include <type_traits>
+#include <stdexcept>
+#include <cmath>
+
+namespace nn
+{
+    typedef enum
+    {
+        CONCAT,
+        SUM,
+        MEAN
+    } pooling_t;
+
+    // Embedding Layer
+    //
+    // Maps a bag of BAG integer ids to rows of a VOCAB x DIM table, row-major as table[id * DIM + k].
+    // The rows are concatenated (CONCAT, BAG*DIM outputs) or pooled into DIM outputs (SUM, MEAN).
+    // The table lives on the heap since vocabularies can have tens of millions of rows.
+    //
+    // apply() remembers which (id, slot) pairs the batch touched, and backprop() sorts them by id so every
+    // referenced row gets one accumulated gradient; rows outside the batch are never read.
+    // The gradients are sparse: `updated` holds the ids of their rows and `row_gradients` one row of DIM values
+    // per id, which is all step() writes and all data-parallel training has to average.
+    template <typename TYPE, std::size_t VOCAB, std::size_t DIM, std::size_t BATCH, std::size_t BAG = 1, pooling_t POOL = SUM>
+    struct Embedding
+    {
+        public:
+
+            static constexpr std::size_t OUT_DIM = (POOL == CONCAT) ? BAG*DIM : DIM;
+
+            std::vector<TYPE> table;
+            TYPE learning_rate;
+
+            // (id, slot in the bag) of every lookup since the last update
+            std::vector<std::pair<std::size_t, std::size_t>> touched;
+            std::size_t batch_samples = 0;
+
+            // Distinct ids of the rows with a gradient from the last backprop, sorted, and their gradients
+            std::vector<std::size_t> updated;
+            std::vector<TYPE> row_gradients;
+
+            Embedding(std::vector<TYPE>&& table_init, TYPE learning_rate) :
+                table{std::move(table_init)},
+                learning_rate{learning_rate}
+            {
+                assert(table.size() == VOCAB*DIM);
+                touched.reserve(BATCH*BAG);
+            }
+
+            Embedding(TYPE learning_rate) :
+                table(VOCAB*DIM),
+                learning_rate{learning_rate}
+            {
+                std::default_random_engine engine(std::random_device{}());
+                std::uniform_real_distribution<TYPE> dist(static_cast<TYPE>(-0.05), static_cast<TYPE>(0.05));
+                std::generate(std::begin(table), std::end(table), [&]{ return dist(engine); });
+                touched.reserve(BATCH*BAG);
+            }
+
+    };
+
+    namespace detail
+    {
+        // Ids come from the data set, possibly as floating point values when they share it with the labels;
+        // anything that is not a whole number below vocab throws std::out_of_range
+        template <typename INDEX>
+        std::size_t embedding_id(INDEX id, std::size_t vocab)
+        {
+            if constexpr (std::is_floating_point_v<INDEX>)
+            {
+                // Checked before the conversion, which is undefined for negative and out of range values
+                if (!(id >= 0 && id < static_cast<INDEX>(vocab)) || id != std::trunc(id))
+                    throw std::out_of_range("embedding id out of range");
+            }
+            else if constexpr (std::is_signed_v<INDEX>)
+            {
+                if (id < 0)
+                    throw std::out_of_range("embedding id out of range");
+            }
+
+            const std::size_t row = static_cast<std::size_t>(id);
+            if (row >= vocab)
+                throw std::out_of_range("embedding id out of range");
+
+            return row;
+        }
+
+        // Gather and pool the rows of one bag
+        template <typename TYPE, std::size_t VOCAB, std::size_t DIM, std::size_t BATCH, std::size_t BAG, pooling_t POOL, typename INDEX>
+        void embed(const Embedding<TYPE, VOCAB, DIM, BATCH, BAG, POOL>& embedding, const INDEX* ids, TYPE* out_vector)
+        {
+            if constexpr (POOL == CONCAT)
+            {
+                for (std::size_t b = 0; b < BAG; ++b)
+                {
+                    const TYPE* row = embedding.table.data() + embedding_id(ids[b], VOCAB) * DIM;
+                    std::copy(row, row + DIM, out_vector + b * DIM);
+                }
+            }
+            else
+            {
+                std::fill(out_vector, out_vector + DIM, static_cast<TYPE>(0));
+                for (std::size_t b = 0; b < BAG; ++b)
+                {
+                    const TYPE* row = embedding.table.data() + embedding_id(ids[b], VOCAB) * DIM;
+                    for (std::size_t k = 0; k < DIM; ++k)
+                    {
+                        out_vector[k] += row[k];
+                    }
+                }
+
+                if constexpr (POOL == MEAN)
+                {
+                    for (std::size_t k = 0; k < DIM; ++k)
+                    {
+                        out_vector[k] /= static_cast<TYPE>(BAG);
+                    }
+                }
+            }
+        }
+    }
+
+    // Processing
+    template <typename TYPE, std::size_t VOCAB, std::size_t DIM, std::size_t BATCH, std::size_t BAG, pooling_t POOL, typename INDEX>
+    std::array<TYPE, Embedding<TYPE, VOCAB, DIM, BATCH, BAG, POOL>::OUT_DIM> apply(Embedding<TYPE, VOCAB, DIM, BATCH, BAG, POOL>& embedding,
+        const std::array<INDEX, BAG>& ids)
+    {
+        std::array<TYPE, Embedding<TYPE, VOCAB, DIM, BATCH, BAG, POOL>::OUT_DIM> out_vector;
+        detail::embed(embedding, ids.data(), out_vector.data());
+
+        for (std::size_t b = 0; b < BAG; ++b)
+        {
+            embedding.touched.emplace_back(detail::embedding_id(ids[b], VOCAB), b);
+        }
+        ++embedding.batch_samples;
+
+        return out_vector;
+    }
+
+    // Inference, leaves the layer untouched
+    template <typename TYPE, std::size_t VOCAB, std::size_t DIM, std::size_t BATCH, std::size_t BAG, pooling_t POOL, typename INDEX>
+    std::array<TYPE, Embedding<TYPE, VOCAB, DIM, BATCH, BAG, POOL>::OUT_DIM> infer(const Embedding<TYPE, VOCAB, DIM, BATCH, BAG, POOL>& embedding,
+        const std::array<INDEX, BAG>& ids)
+    {
+        std::array<TYPE, Embedding<TYPE, VOCAB, DIM, BATCH, BAG, POOL>::OUT_DIM> out_vector;
+        detail::embed(embedding, ids.data(), out_vector.data());
+
+        return out_vector;
+    }
+
+    // Inference on N bags stored one after the other
+    template <std::size_t N, typename TYPE, std::size_t VOCAB, std::size_t DIM, std::size_t BATCH, std::size_t BAG, pooling_t POOL, typename INDEX>
+    std::array<TYPE, Embedding<TYPE, VOCAB, DIM, BATCH, BAG, POOL>::OUT_DIM*N> infer_batch(const Embedding<TYPE, VOCAB, DIM, BATCH, BAG, POOL>& embedding,
+        const std::array<INDEX, BAG*N>& ids)
+    {
+        constexpr std::size_t OUT_DIM = Embedding<TYPE, VOCAB, DIM, BATCH, BAG, POOL>::OUT_DIM;
+
+        std::array<TYPE, OUT_DIM*N> out_batch;
+        for (std::size_t s = 0; s < N; ++s)
+        {
+            detail::embed(embedding, ids.data() + s * BAG, out_batch.data() + s * OUT_DIM);
+        }
+
+        return out_batch;
+    }
+
+    // Backpropagation
+    // in_gradient is the gradient averaged over the batch, so a row referenced c times in the batch gets
+    // c/batch_samples of its slot's gradient (divided by BAG for MEAN pooling). The embedding is the input
+    // layer, the returned gradient with respect to the ids is zero.
+    template <typename TYPE, std::size_t VOCAB, std::size_t DIM, std::size_t BATCH, std::size_t BAG, pooling_t POOL>
+    std::array<TYPE, BAG> backprop(Embedding<TYPE, VOCAB, DIM, BATCH, BAG, POOL>& embedding,
+        const std::array<TYPE, Embedding<TYPE, VOCAB, DIM, BATCH, BAG, POOL>::OUT_DIM>& in_gradient)
+    {
+        embedding.updated.clear();
+        embedding.row_gradients.clear();
+        if (embedding.batch_samples == 0)
+            return {};
+
+        TYPE scale = static_cast<TYPE>(1) / static_cast<TYPE>(embedding.batch_samples);
+        if constexpr (POOL == MEAN)
+            scale /= static_cast<TYPE>(BAG);
+
+        // Group the lookups by row, each distinct row then gets one gradient
+        std::sort(embedding.touched.begin(), embedding.touched.end());
+
+        for (auto run = embedding.touched.begin(); run != embedding.touched.end(); )
+        {
+            const std::size_t id = run->first;
+            embedding.row_gradients.resize(embedding.row_gradients.size() + DIM, static_cast<TYPE>(0));
+            TYPE* row_gradient = embedding.row_gradients.data() + embedding.row_gradients.size() - DIM;
+
+            for (; run != embedding.touched.end() && run->first == id; ++run)
+            {
+                const TYPE* slot_gradient = in_gradient.data() + ((POOL == CONCAT) ? run->second * DIM : 0);
+                for (std::size_t k = 0; k < DIM; ++k)
+                {
+                    row_gradient[k] += scale * slot_gradient[k];
+                }
+            }
+            embedding.updated.push_back(id);
+        }
+
+        embedding.touched.clear();
+        embedding.batch_samples = 0;
+
+        return {};
+    }
+
+    // Apply the gradients of the last backprop() to their rows
+    template <typename TYPE, std::size_t VOCAB, std::size_t DIM, std::size_t BATCH, std::size_t BAG, pooling_t POOL>
+    void step(Embedding<TYPE, VOCAB, DIM, BATCH, BAG, POOL>& embedding) noexcept
+    {
+        assert(embedding.row_gradients.size() == embedding.updated.size() * DIM);
+
+        for (std::size_t r = 0; r < embedding.updated.size(); ++r)
+        {
+            TYPE* row = embedding.table.data() + embedding.updated[r] * DIM;
+            const TYPE* row_gradient = embedding.row_gradients.data() + r * DIM;
+            for (std::size_t k = 0; k < DIM; ++k)
+            {
+                row[k] -= embedding.learning_rate * row_gradient[k];
+            }
+        }
+    }
+
+    template <typename TYPE, std::size_t VOCAB, std::size_t DIM, std::size_t BATCH, std::size_t BAG, pooling_t POOL>
+    std::array<TYPE, BAG> update(Embedding<TYPE, VOCAB, DIM, BATCH, BAG, POOL>& embedding,
+        const std::array<TYPE, Embedding<TYPE, VOCAB, DIM, BATCH, BAG, POOL>::OUT_DIM>& in_gradient)
+    {
+        std::array<TYPE, BAG> out_gradient = backprop(embedding, in_gradient);
+        step(embedding);
+
+        return out_gradient;
+    }
+
+    // The whole table, e.g. to broadcast the initial replica
+    template <typename TYPE, std::size_t VOCAB, std::size_t DIM, std::size_t BATCH, std::size_t BAG, pooling_t POOL>
+    void parameters(Embedding<TYPE, VOCAB, DIM, BATCH, BAG, POOL>& embedding, auto&& visit)
+    {
+        visit(std::span<TYPE>{embedding.table});
+    }
+
+    // The rows of row_gradients; replicas have gradients for different rows, which the Communicator first
+    // spreads onto the union of the ids
+    template <typename TYPE, std::size_t VOCAB, std::size_t DIM, std::size_t BATCH, std::size_t BAG, pooling_t POOL>
+    void gradients(Embedding<TYPE, VOCAB, DIM, BATCH, BAG, POOL>& embedding, auto&& visit)
+    {
+        visit(std::span<TYPE>{embedding.row_gradients});
+    }
+
+    template <typename TYPE, std::size_t VOCAB, std::size_t DIM, std::size_t BATCH, std::size_t BAG, pooling_t POOL>
+    void refresh(Embedding<TYPE, VOCAB, DIM, BATCH, BAG, POOL>&) noexcept
+    {}
+}
+
+#endif
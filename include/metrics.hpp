@@ -0,0 +1,64 @@
+#ifndef _METRICS_H
+#define _METRICS_H
+
+#include <array>
+#include <vector>
+#include <cstddef>
+#include <algorithm>
+
+namespace nn
+{
+    // Classification metrics over a set of samples with one-hot (or arg-max) labels.
+    // Everything but the loss is an exact count, so partial Metrics can be merged in any order.
+    template <typename TYPE, std::size_t LABELS_DIM>
+    struct Metrics
+    {
+        public:
+
+            std::size_t samples = 0;
+            TYPE loss = 0;
+            std::size_t correct = 0;
+            std::size_t top_k_correct = 0;
+
+            // confusion_matrix[true_class * LABELS_DIM + predicted_class]
+            std::vector<std::size_t> confusion_matrix = std::vector<std::size_t>(LABELS_DIM*LABELS_DIM, 0);
+
+            TYPE accuracy() const noexcept
+            {
+                return samples ? static_cast<TYPE>(correct) / static_cast<TYPE>(samples) : static_cast<TYPE>(0);
+            }
+
+            TYPE top_k_accuracy() const noexcept
+            {
+                return samples ? static_cast<TYPE>(top_k_correct) / static_cast<TYPE>(samples) : static_cast<TYPE>(0);
+            }
+    };
+
+    // Count one prediction; the label is in the top k if fewer than k classes score strictly higher
+    template <std::size_t TOP_K, typename TYPE, std::size_t LABELS_DIM>
+    void record(Metrics<TYPE, LABELS_DIM>& metrics, const TYPE* prediction, const TYPE* label) noexcept
+    {
+        const std::size_t predicted = std::max_element(prediction, prediction + LABELS_DIM) - prediction;
+        const std::size_t expected = std::max_element(label, label + LABELS_DIM) - label;
+        const std::size_t higher = std::count_if(prediction, prediction + LABELS_DIM,
+            [&](TYPE p){ return p > prediction[expected]; });
+
+        ++metrics.samples;
+        metrics.correct += (predicted == expected);
+        metrics.top_k_correct += (higher < TOP_K);
+        ++metrics.confusion_matrix[expected * LABELS_DIM + predicted];
+    }
+
+    // Add the counts of `from` into `into`, the loss is left to the caller
+    template <typename TYPE, std::size_t LABELS_DIM>
+    void merge(Metrics<TYPE, LABELS_DIM>& into, const Metrics<TYPE, LABELS_DIM>& from) noexcept
+    {
+        into.samples += from.samples;
+        into.correct += from.correct;
+        into.top_k_correct += from.top_k_correct;
+        std::transform(into.confusion_matrix.begin(), into.confusion_matrix.end(), from.confusion_matrix.begin(),
+            into.confusion_matrix.begin(), [](std::size_t a, std::size_t b){ return a + b; });
+    }
+}
+
+#endif
@@ -3,19 +3,146 @@
 
 #include <activation.hpp>
 #include <dense.hpp>
+#include <batchnorm.hpp>
+#include <embedding.hpp>
 #include <loss.hpp>
+#include <metrics.hpp>
+#include <threadpool.hpp>
 #include <span>
 #include <array>
+#include <vector>
 #include <tuple>
 #include <ranges>
+#include <memory>
+#include <mutex>
+#include <algorithm>
 
 namespace nn
 {
 
+    // Processing of a whole batch during training, one sample after the other.
+    // Layers whose output depends on the rest of the batch (BatchNorm) overload it.
+    template <typename LAYER, typename SAMPLE>
+    auto apply_batch(LAYER& layer, const std::vector<SAMPLE>& in_batch)
+    {
+        std::vector<decltype(nn::apply(layer, in_batch.front()))> out_batch;
+        out_batch.reserve(in_batch.size());
+
+        for (const SAMPLE& in_vector : in_batch)
+        {
+            out_batch.push_back(nn::apply(layer, in_vector));
+        }
+
+        return out_batch;
+    }
+
+    namespace detail
+    {
+        // Apply the layers in order on a whole batch, one layer at a time
+        auto forward_batch(const auto& in_batch, auto& layer, auto&... layers)
+        {
+            auto intermediate_result = nn::apply_batch(layer, in_batch);
+
+            if constexpr (sizeof...(layers) > 0)
+            {
+                return forward_batch(intermediate_result, layers...);
+            }
+            else
+            {
+                return intermediate_result;
+            }
+        }
+
+        // Backpropagate through the layers in reverse order, calling on_gradients(layer) as soon as the gradients
+        // of a layer are ready. The last layer comes first, so whatever on_gradients starts can overlap with the
+        // backward pass of the earlier layers. The parameters are left to the caller, see step().
+        auto backward(const auto& in_gradient, auto& on_gradients, auto& layer, auto&... layers)
+        {
+            if constexpr (sizeof...(layers) > 0)
+            {
+                std::array intermediate_result = backward(in_gradient, on_gradients, layers...);
+                std::array out_gradient = nn::backprop(layer, intermediate_result);
+                on_gradients(layer);
+
+                return out_gradient;
+            }
+            else
+            {
+                std::array out_gradient = nn::backprop(layer, in_gradient);
+                on_gradients(layer);
+
+                return out_gradient;
+            }
+        }
+
+        // Run one batch starting at train_ptr/labels_ptr through the layers, backpropagate and return the mean loss
+        template <std::size_t TRAIN_DIM,
+            std::size_t LABELS_DIM,
+            std::size_t BATCH,
+            typename TYPE,
+            losstype_t LOSS,
+            typename ON_GRADIENTS,
+            typename ... LAYERS>
+        TYPE train_batch(const TYPE* train_ptr,
+            const TYPE* labels_ptr,
+            const Loss<LOSS, LABELS_DIM> loss,
+            ON_GRADIENTS& on_gradients,
+            LAYERS&... layers)
+        {
+            // Gather the batch and run it through the layers one layer at a time, so that every layer sees the
+            // whole batch before the next one starts
+            std::vector<std::array<TYPE, TRAIN_DIM>> samples(BATCH);
+            for (auto& train_slice : samples)
+            {
+                std::copy(train_ptr, train_ptr + TRAIN_DIM, std::begin(train_slice));
+                train_ptr += TRAIN_DIM;
+            }
+
+            const auto results = forward_batch(samples, layers...);
+
+            // Reset the total loss and gradient after each batch
+            TYPE compounded_loss = 0;
+            std::array<TYPE, LABELS_DIM> compounded_gradient;
+            std::fill(std::begin(compounded_gradient), std::end(compounded_gradient), static_cast<TYPE>(0));
+
+            // Loop over all samples in the batch
+            for (const auto& result : results)
+            {
+                std::array<TYPE, LABELS_DIM> labels_slice;
+                std::copy(labels_ptr, labels_ptr + LABELS_DIM, std::begin(labels_slice));
+
+                // Compute and compound the loss
+                compounded_loss += calculate_loss(loss, result, labels_slice);
+                std::array gradient_vector = calculate_gradient_vector(loss, result, labels_slice);
+
+                auto gradient_vector_iter = std::begin(gradient_vector);
+                std::for_each(std::begin(compounded_gradient), std::end(compounded_gradient), [&](auto& val){
+                    val += *gradient_vector_iter;
+                    ++gradient_vector_iter;
+                });
+
+                // Set up next iteration
+                labels_ptr += LABELS_DIM;
+            }
+
+            // Divide loss and elements of gradient by batch size
+            compounded_loss /= static_cast<TYPE>(BATCH);
+            std::for_each(std::begin(compounded_gradient), std::end(compounded_gradient), [&](auto& val){
+                val /= static_cast<TYPE>(BATCH);
+            });
+
+            // Compute the gradients of every layer
+            (void) backward(compounded_gradient, on_gradients, layers...);
+
+            return compounded_loss;
+        }
+    }
+
     // Template function for training a neural network
     // The function trains a neural network on a given training set and labels set
     // The function uses the specified number of epochs and layers
     // The function calculates the compounded loss after each epoch and updates the layers
+    // DEPTH is the number of samples in the sets, which are consumed in DEPTH/BATCH batches
 
     template <std::size_t TRAIN_DIM,
         std::size_t LABELS_DIM,
@@ -28,115 +155,204 @@ namespace nn
         const std::array<TYPE, LABELS_DIM*DEPTH>& labels_set,
         const std::size_t epochs,
         const Loss<LOSS, LABELS_DIM> loss,
-        LAYERS&... layers) noexcept
+        LAYERS&... layers)
     {
-        // Stores the total loss after each epoch
-        TYPE compounded_loss;
+        static_assert(DEPTH >= BATCH, "training set smaller than one batch");
+
+        // Stores the loss of the last batch
+        TYPE compounded_loss = 0;
+        auto step_layer = [](auto& layer){ nn::step(layer); };
 
         // Loop over the specified number of epochs
         for (std::size_t k = 0; k<epochs; ++k)
         {
-            // C++ spans are broken (or very little intuitive to use) so using raw pointers to slice. Sue me, retards.
-            TYPE* train_span = std::data(std::begin(train_set));
-            TYPE* labels_span = std::data(std::begin(labels_set));
-            std::size_t i = 0;
+            const TYPE* train_ptr = train_set.data();
+            const TYPE* labels_ptr = labels_set.data();
 
             // Loop over all of the batches in the training set
-            while (i < DEPTH)
+            for (std::size_t i = 0; i < DEPTH / BATCH; ++i)
+            {
+                compounded_loss = detail::train_batch<TRAIN_DIM, LABELS_DIM, BATCH>(train_ptr, labels_ptr, loss, step_layer, layers...);
+
+                // Set up next iteration
+                train_ptr += TRAIN_DIM*BATCH;
+                labels_ptr += LABELS_DIM*BATCH;
+            }
+        }
+
+        return compounded_loss;
+    }
+
+    // Same, with the parallel kernels of the layers running on `pool` instead of the current pool
+    template <std::size_t TRAIN_DIM,
+        std::size_t LABELS_DIM,
+        std::size_t DEPTH,
+        std::size_t BATCH,
+        typename TYPE,
+        losstype_t LOSS,
+        typename ... LAYERS>
+    TYPE train(const std::array<TYPE, TRAIN_DIM*DEPTH>& train_set,
+        const std::array<TYPE, LABELS_DIM*DEPTH>& labels_set,
+        const std::size_t epochs,
+        const Loss<LOSS, LABELS_DIM> loss,
+        ThreadPool& pool,
+        LAYERS&... layers)
+    {
+        PoolScope scope{pool};
+
+        return train<TRAIN_DIM, LABELS_DIM, DEPTH, BATCH>(train_set, labels_set, epochs, loss, layers...);
+    }
+
+    namespace detail
+    {
+        // Inference through the const path of the layers, one sample
+        auto infer_forward(const auto& in_vector, const auto& layer, const auto&... layers)
+        {
+            std::array intermediate_result = nn::infer(layer, in_vector);
+
+            if constexpr (sizeof...(layers) > 0)
             {
-                TYPE* train_batch_span = std::data(std::begin(train_span));
-                TYPE* labels_batch_span = std::data(std::begin(labels_span));
-                std::size_t train_batch_index = 0;
-                std::size_t labels_batch_index = 0;
-                
-                // Reset the total loss and gradient after each batch
-                compounded_loss = 0;
-                std::array<TYPE, LABELS_DIM> compounded_gradient;
-                std::fill(std::begin(compounded_gradient), std::end(compounded_gradient), static_cast<TYPE>(0));
-                
-                // Loop over all samples in the batch
-                while (train_batch_index < BATCH && labels_batch_index < BATCH)
+                return infer_forward(intermediate_result, layers...);
+            }
+            else
+            {
+                return intermediate_result;
+            }
+        }
+
+        // Inference through the const path of the layers, N samples at once
+        template <std::size_t N>
+        auto infer_forward_batch(const auto& in_batch, const auto& layer, const auto&... layers)
+        {
+            std::array intermediate_result = nn::infer_batch<N>(layer, in_batch);
+
+            if constexpr (sizeof...(layers) > 0)
+            {
+                return infer_forward_batch<N>(intermediate_result, layers...);
+            }
+            else
+            {
+                return intermediate_result;
+            }
+        }
+    }
+
+    // Evaluate the layers on a test set with the threads of `pool`.
+    // The set is cut into fixed chunks of CHUNK samples, one task each, which run through the layers BLOCK
+    // samples per forward pass. Counts go to accumulators that a task borrows for its chunk (one per thread
+    // at a time) and that are merged at the end; the loss is summed per chunk and the chunks are added in
+    // order, so the result does not depend on the number of threads.
+    template <std::size_t TEST_DIM,
+        std::size_t LABELS_DIM,
+        std::size_t DEPTH,
+        std::size_t TOP_K = 5,
+        typename TYPE,
+        losstype_t LOSS,
+        typename ... LAYERS>
+    Metrics<TYPE, LABELS_DIM> evaluate(const std::array<TYPE, TEST_DIM*DEPTH>& test_set,
+        const std::array<TYPE, LABELS_DIM*DEPTH>& labels_set,
+        const Loss<LOSS, LABELS_DIM> loss,
+        ThreadPool& pool,
+        const LAYERS&... layers)
+    {
+        constexpr std::size_t BLOCK = INFER_BLOCK;
+        constexpr std::size_t CHUNK = 64 * BLOCK;
+        constexpr std::size_t CHUNKS = (DEPTH + CHUNK - 1) / CHUNK;
+
+        std::vector<double> chunk_loss(CHUNKS, 0.0);
+
+        // Accumulators not in use by a task right now
+        std::vector<std::unique_ptr<Metrics<TYPE, LABELS_DIM>>> accumulators;
+        std::vector<Metrics<TYPE, LABELS_DIM>*> idle;
+        std::mutex accumulators_mutex;
+
+        auto score = [&](Metrics<TYPE, LABELS_DIM>& metrics, double& loss_sum, const TYPE* prediction, std::size_t sample)
+        {
+            std::array<TYPE, LABELS_DIM> prediction_slice;
+            std::copy(prediction, prediction + LABELS_DIM, std::begin(prediction_slice));
+            std::array<TYPE, LABELS_DIM> labels_slice;
+            std::copy(labels_set.data() + sample * LABELS_DIM, labels_set.data() + (sample + 1) * LABELS_DIM, std::begin(labels_slice));
+
+            loss_sum += static_cast<double>(calculate_loss(loss, prediction_slice, labels_slice));
+            record<TOP_K>(metrics, prediction_slice.data(), labels_slice.data());
+        };
+
+        auto work = [&](std::size_t c)
+        {
+            Metrics<TYPE, LABELS_DIM>* metrics;
+            {
+                std::lock_guard lock{accumulators_mutex};
+                if (idle.empty())
                 {
-                    std::array<TYPE, TRAIN_DIM> train_slice;
-                    std::copy(train_batch_span, train_batch_span + TRAIN_DIM, std::begin(train_slice)); 
-                    std::array<TYPE, LABELS_DIM> labels_slice;
-                    std::copy(labels_batch_span, labels_batch_span+LABELS_DIM, std::begin(labels_slice));
-
-                    // Apply the layers on the sample data
-                    auto statically_recursive_apply = [](auto& self, const auto& in_vector, auto& layer, auto&... layers)
-                    {
-                        std::array intermediate_result = nn::apply(layer, in_vector);
-                        //std::span result_span{std::begin(intermediate_result), std::end(intermediate_result)};
-
-                        if constexpr (sizeof...(layers) > 0)
-                        {
-                            return self(self, intermediate_result, layers...);
-                        }
-                        else
-                        {
-                            return intermediate_result;
-                        }
-                    };
-
-                    std::array result = statically_recursive_apply(statically_recursive_apply, train_batch_span, layers...);
-                    //std::span result_span{std::begin(result), std::end(result)};
-
-
-                    // Compute and compound the loss
-                    compounded_loss += calculate_loss(loss, result, labels_batch_span);
-                    std::array gradient_vector = calculate_gradient_vector(loss, result, labels_batch_span);
-                    
-                    auto gradient_vector_iter = std::begin(gradient_vector);
-                    std::for_each(std::begin(compounded_gradient), std::end(compounded_gradient), [&](auto& val){
-                        val += *gradient_vector_iter;
-                        ++gradient_vector_iter;
-                    });
-
-                    // Set up next iteration
-                    ++labels_batch_index;
-                    ++train_batch_index;
-                    train_batch_span += TRAIN_DIM;
-                    labels_batch_span += LABELS_DIM;
+                    accumulators.push_back(std::make_unique<Metrics<TYPE, LABELS_DIM>>());
+                    idle.push_back(accumulators.back().get());
                 }
+                metrics = idle.back();
+                idle.pop_back();
+            }
 
-                // Divide loss and elements of gradient by batch size
-                compounded_loss /= static_cast<TYPE>(BATCH);
-                std::for_each(std::begin(compounded_gradient), std::end(compounded_gradient), [&](auto& val){
-                    val /= static_cast<TYPE>(BATCH);
-                });
+            const std::size_t end = std::min(DEPTH, (c + 1) * CHUNK);
+            std::size_t sample = c * CHUNK;
+            double loss_sum = 0.0;
+
+            // Full blocks through the batched kernels
+            for (; sample + BLOCK <= end; sample += BLOCK)
+            {
+                std::array<TYPE, TEST_DIM*BLOCK> test_block;
+                std::copy(test_set.data() + sample * TEST_DIM, test_set.data() + (sample + BLOCK) * TEST_DIM, std::begin(test_block));
 
-                
-                // Update every layer with the computed gradient
-                auto statically_recursive_update = [](auto& self, const auto& in_gradient, auto& layer, auto&... layers)
+                std::array result = detail::infer_forward_batch<BLOCK>(test_block, layers...);
+                for (std::size_t s = 0; s < BLOCK; ++s)
                 {
-                
-                    if constexpr (sizeof...(layers) > 0)
-                    {
-                        std::array intermediate_result = self(self, in_gradient, layers...);
-                        //std::span result_span{std::begin(intermediate_result), std::end(intermediate_result)};
-
-                        return std::move(nn::update(layer, intermediate_result));
-                    }
-                    else
-                    {
-                        return std::move(nn::update(layer, in_gradient));
-                    }
-                };
-
-                //std::span compounded_gradient_span{std::begin(compounded_gradient), std::end(compounded_gradient)};
-                (void) statically_recursive_update(statically_recursive_update, compounded_gradient, layers...);
+                    score(*metrics, loss_sum, result.data() + s * LABELS_DIM, sample + s);
+                }
+            }
 
-                // Set up next iteration
-                ++i;
-                train_span += TRAIN_DIM*BATCH;
-                labels_span += LABELS_DIM*BATCH;
+            // Remaining samples one at a time
+            for (; sample < end; ++sample)
+            {
+                std::array<TYPE, TEST_DIM> test_slice;
+                std::copy(test_set.data() + sample * TEST_DIM, test_set.data() + (sample + 1) * TEST_DIM, std::begin(test_slice));
+
+                std::array result = detail::infer_forward(test_slice, layers...);
+                score(*metrics, loss_sum, result.data(), sample);
             }
+
+            chunk_loss[c] = loss_sum;
+
+            std::lock_guard lock{accumulators_mutex};
+            idle.push_back(metrics);
+        };
+
+        {
+            // Kernels inside the layers split their work on the same pool
+            PoolScope scope{pool};
+            parallel_for(pool, 0, CHUNKS, 1, [&](std::size_t first, std::size_t last)
+            {
+                for (std::size_t c = first; c < last; ++c)
+                {
+                    work(c);
+                }
+            });
         }
 
+        Metrics<TYPE, LABELS_DIM> result;
+        for (const auto& metrics : accumulators)
+        {
+            merge(result, *metrics);
+        }
 
-        return compounded_loss;
+        double loss_sum = 0.0;
+        for (double l : chunk_loss)
+        {
+            loss_sum += l;
+        }
+        result.loss = static_cast<TYPE>(loss_sum / static_cast<double>(DEPTH));
+
+        return result;
     }
 
+    // Mean loss of the layers on a test set, see evaluate
     template <std::size_t TEST_DIM,
         std::size_t LABELS_DIM,
         std::size_t DEPTH,
@@ -146,49 +362,39 @@ namespace nn
     TYPE test(const std::array<TYPE, TEST_DIM*DEPTH>& test_set,
         const std::array<TYPE, LABELS_DIM*DEPTH>& labels_set,
         Loss<LOSS, LABELS_DIM> loss,
-        LAYERS&... layers) noexcept
+        ThreadPool& pool,
+        const LAYERS&... layers)
         {
-            TYPE compounded_loss = 0;
-            std::span<TYPE, TEST_DIM> test_span{std::ranges::all_of()};
-            std::span<TYPE, LABELS_DIM> labels_span; labels_span{std::begin(labels_set), LABELS_DIM};
-            std::size_t i = 0;
+            return evaluate<TEST_DIM, LABELS_DIM, DEPTH>(test_set, labels_set, loss, pool, layers...).loss;
+        }
 
-            while (std::size(test_span) > 0 && std::size(labels_span) > 0)
-            {
-                // Apply the layers on the sample data
-                auto statically_recursive_apply = [](auto& self, const auto& in_vector, auto& layer, auto&... layers)
-                {
-                    std::array intermediate_result = nn::apply(layer, in_vector);
-                    //std::span span_result{std::begin(intermediate_result), std::end(intermediate_result)};
-
-                    if constexpr (sizeof...(layers) > 0)
-                    {
-                        return self(self, intermediate_result, layers...);
-                    }
-                    else
-                    {
-                        return intermediate_result;
-                    }
-                };
-
-                std::array result = statically_recursive_apply(statically_recursive_apply, test_span, layers...);
-                //std::span span_result{std::begin(result), std::end(result)};
-                compounded_loss += calculate_loss(loss, result, labels_span);
-
-                ++i;
-                test_span = test_span.subspan(TEST_DIM*i, TEST_DIM);
-                labels_span = labels_span.subspan(LABELS_DIM*i, LABELS_DIM);
-            }
-            return (compounded_loss / static_cast<TYPE>(DEPTH));
+    // Same, on the current pool (see current_pool)
+    template <std::size_t TEST_DIM,
+        std::size_t LABELS_DIM,
+        std::size_t DEPTH,
+        typename TYPE,
+        losstype_t LOSS,
+        typename ... LAYERS>
+    TYPE test(const std::array<TYPE, TEST_DIM*DEPTH>& test_set,
+        const std::array<TYPE, LABELS_DIM*DEPTH>& labels_set,
+        Loss<LOSS, LABELS_DIM> loss,
+        const LAYERS&... layers)
+        {
+            return evaluate<TEST_DIM, LABELS_DIM, DEPTH>(test_set, labels_set, loss, current_pool(), layers...).loss;
         }
-    
-    
-    template <std::size_t DATA_DIM, std::size_t DATA_DEPTH, typename TYPE>
-    void split_data_labels(std::array<TYPE, DIM*DEPTH> data,
-        std::array<TYPE, (DATA_DIM-1)*DEPTH> train_set,
-        std::array<TYPE, DEPTH>)
+
+
+    // Split rows of DATA_DIM values into the first DATA_DIM-1 values and a trailing label
+    template <std::size_t DATA_DIM, std::size_t DEPTH, typename TYPE>
+    void split_data_labels(const std::array<TYPE, DATA_DIM*DEPTH>& data,
+        std::array<TYPE, (DATA_DIM-1)*DEPTH>& train_set,
+        std::array<TYPE, DEPTH>& labels_set) noexcept
     {
-        
+        for (std::size_t i = 0; i < DEPTH; ++i)
+        {
+            std::copy(data.begin() + i * DATA_DIM, data.begin() + (i + 1) * DATA_DIM - 1, train_set.begin() + i * (DATA_DIM - 1));
+            labels_set[i] = data[(i + 1) * DATA_DIM - 1];
+        }
     }
 }
 
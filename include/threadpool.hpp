@@ -0,0 +1,490 @@
+#ifndef _THREADPOOL_H
+#define _THREADPOOL_H
+
+#include <vector>
+#include <deque>
+#include <memory>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <exception>
+#include <algorithm>
+#include <fstream>
+#include <string>
+#include <string_view>
+#include <span>
+#include <tuple>
+#include <utility>
+#include <cstddef>
+#include <cstdlib>
+#include <cerrno>
+#include <chrono>
+
+#include <pthread.h>
+#include <sched.h>
+
+namespace nn
+{
+    // Work-stealing thread pool shared by every parallel kernel of the library.
+    //
+    // Each worker owns a deque: it pushes and pops its own tasks at the back and steals from the front of
+    // the others, trying the workers on its own NUMA node first. Threads outside the pool submit to a shared
+    // queue. A thread waiting on a TaskGroup runs queued tasks meanwhile, so a task can start and wait for
+    // nested parallel work without deadlocking the pool.
+    //
+    // Workers are placed on the allowed CPUs node by node and, with pin_threads, bound to them.
+    // Each worker has a scratch arena that kernels can borrow for the duration of a task; allreduce() takes
+    // its receive buffer from it.
+    struct ThreadPool
+    {
+        public:
+
+            // Upper bound for NN_NUM_THREADS
+            static constexpr std::size_t MAX_THREADS = 1024;
+
+            // Threads that take part in parallel work, the calling one included: NN_NUM_THREADS if it is a
+            // whole number from 1 to MAX_THREADS (larger ones are clamped), the number of hardware threads otherwise
+            static std::size_t default_threads() noexcept
+            {
+                if (const char* threads = std::getenv("NN_NUM_THREADS"))
+                {
+                    char* end = nullptr;
+                    errno = 0;
+                    const long long requested = std::strtoll(threads, &end, 10);
+                    if (end != threads && *end == '\0' && requested >= 1)
+                        return (errno == ERANGE) ? MAX_THREADS : std::min<std::size_t>(requested, MAX_THREADS);
+                }
+
+                return std::max(1u, std::thread::hardware_concurrency());
+            }
+
+            // Whether workers are bound to their CPU by default: NN_PIN_THREADS=1 pins them, anything else does not
+            static bool default_pin_threads() noexcept
+            {
+                const char* pin = std::getenv("NN_PIN_THREADS");
+                return pin && std::string_view{pin} == "1";
+            }
+
+            // `threads` workers; the threads that wait on the pool help as well, so 0 runs everything inline.
+            // The defaults leave room for the calling thread and follow the environment, like default_pool().
+            explicit ThreadPool(std::size_t threads = default_threads() - 1, bool pin_threads = default_pin_threads())
+            {
+                const std::vector<std::pair<int, int>> placement = cpu_placement();
+                thread_count = threads;
+                threads_.reserve(threads);
+
+                for (std::size_t i = 0; i <= threads; ++i)
+                {
+                    workers.push_back(std::make_unique<Worker>());
+                }
+                for (std::size_t i = 0; i < threads && !placement.empty(); ++i)
+                {
+                    std::tie(workers[i]->cpu, workers[i]->node) = placement[i % placement.size()];
+                }
+
+                // Steal from the same node first, then from everybody else, then from the shared queue
+                for (std::size_t i = 0; i < threads; ++i)
+                {
+                    for (int same_node : {1, 0})
+                    {
+                        for (std::size_t k = 1; k < threads; ++k)
+                        {
+                            const std::size_t victim = (i + k) % threads;
+                            if ((workers[victim]->node == workers[i]->node) == static_cast<bool>(same_node))
+                                workers[i]->victims.push_back(victim);
+                        }
+                    }
+                    workers[i]->victims.push_back(threads);
+                }
+                for (std::size_t k = 0; k < threads; ++k)
+                {
+                    workers[threads]->victims.push_back(k);
+                }
+
+                for (std::size_t i = 0; i < threads; ++i)
+                {
+                    threads_.emplace_back([this, i]{ run(i); });
+
+                    if (pin_threads && workers[i]->cpu >= 0)
+                    {
+                        cpu_set_t set;
+                        CPU_ZERO(&set);
+                        CPU_SET(workers[i]->cpu, &set);
+                        pthread_setaffinity_np(threads_.back().native_handle(), sizeof(set), &set);
+                    }
+                }
+            }
+
+            ThreadPool(const ThreadPool&) = delete;
+            ThreadPool& operator=(const ThreadPool&) = delete;
+
+            ~ThreadPool()
+            {
+                {
+                    std::lock_guard lock{sleep_mutex};
+                    stopping = true;
+                }
+                sleep_cv.notify_all();
+
+                for (std::thread& thread : threads_)
+                {
+                    thread.join();
+                }
+            }
+
+            // Number of worker threads
+            std::size_t size() const noexcept
+            {
+                return thread_count;
+            }
+
+            // Index of the calling worker, size() for threads outside the pool
+            std::size_t worker_index() const noexcept
+            {
+                return (current_pool_ == this) ? current_index : size();
+            }
+
+            // Run one queued task, own tasks first, then stolen ones; false if there was nothing to run
+            bool run_one()
+            {
+                const std::size_t self = worker_index();
+                std::function<void()> task;
+
+                if (self < size() && pop(*workers[self], task, true))
+                {
+                    task();
+                    return true;
+                }
+                for (std::size_t victim : workers[self]->victims)
+                {
+                    if (pop(*workers[victim], task, false))
+                    {
+                        task();
+                        return true;
+                    }
+                }
+                if (self == size() && pop(*workers[self], task, false))
+                {
+                    task();
+                    return true;
+                }
+
+                return false;
+            }
+
+            // At least `bytes` of scratch memory owned by the calling worker, valid until its task returns or
+            // waits on a TaskGroup (the worker may then run another task that borrows the same arena).
+            // Threads outside the pool get a thread-local arena.
+            std::span<std::byte> scratch(std::size_t bytes)
+            {
+                thread_local std::vector<std::byte> outside_arena;
+                std::vector<std::byte>& arena = (worker_index() < size()) ? workers[worker_index()]->arena : outside_arena;
+
+                if (arena.size() < bytes)
+                    arena.resize(bytes);
+
+                return {arena.data(), bytes};
+            }
+
+            // The pool of the calling worker, if any
+            static ThreadPool* this_pool() noexcept
+            {
+                return current_pool_;
+            }
+
+        private:
+
+            // Tasks are queued through TaskGroup::run(), which keeps their exceptions away from the workers
+            friend struct TaskGroup;
+
+            struct Worker
+            {
+                std::mutex mutex;
+                std::deque<std::function<void()>> tasks;
+                std::vector<std::size_t> victims;
+                std::vector<std::byte> arena;
+                int cpu = -1;
+                int node = 0;
+            };
+
+            // One extra "worker" at index size() holds the tasks submitted from outside
+            std::vector<std::unique_ptr<Worker>> workers;
+            std::vector<std::thread> threads_;
+            std::size_t thread_count;
+            std::atomic<std::size_t> queued{0};
+            bool stopping = false;
+            std::mutex sleep_mutex;
+            std::condition_variable sleep_cv;
+
+            inline static thread_local ThreadPool* current_pool_ = nullptr;
+            inline static thread_local std::size_t current_index = 0;
+
+            void submit(std::function<void()> task)
+            {
+                Worker& worker = *workers[worker_index()];
+                {
+                    std::lock_guard lock{worker.mutex};
+                    worker.tasks.push_back(std::move(task));
+                }
+                queued.fetch_add(1, std::memory_order_release);
+
+                // Taking the lock orders the notification after a sleeping worker's check of `queued`
+                { std::lock_guard lock{sleep_mutex}; }
+                sleep_cv.notify_one();
+            }
+
+            bool pop(Worker& worker, std::function<void()>& task, bool own)
+            {
+                std::lock_guard lock{worker.mutex};
+                if (worker.tasks.empty()) return false;
+
+                if (own)
+                {
+                    task = std::move(worker.tasks.back());
+                    worker.tasks.pop_back();
+                }
+                else
+                {
+                    task = std::move(worker.tasks.front());
+                    worker.tasks.pop_front();
+                }
+                queued.fetch_sub(1, std::memory_order_relaxed);
+
+                return true;
+            }
+
+            void run(std::size_t index)
+            {
+                current_pool_ = this;
+                current_index = index;
+
+                for (;;)
+                {
+                    if (run_one()) continue;
+
+                    std::unique_lock lock{sleep_mutex};
+                    sleep_cv.wait(lock, [this]{ return stopping || queued.load(std::memory_order_acquire) > 0; });
+                    if (stopping) return;
+                }
+            }
+
+            // "0-3,8,10-11" -> {0, 1, 2, 3, 8, 10, 11}
+            static std::vector<int> parse_cpulist(const std::string& list)
+            {
+                std::vector<int> cpus;
+                std::size_t pos = 0;
+                while (pos < list.size())
+                {
+                    std::size_t end = list.find(',', pos);
+                    if (end == std::string::npos) end = list.size();
+                    const std::string range = list.substr(pos, end - pos);
+                    const std::size_t dash = range.find('-');
+                    const int first = std::atoi(range.c_str());
+                    const int last = (dash == std::string::npos) ? first : std::atoi(range.c_str() + dash + 1);
+                    for (int cpu = first; cpu <= last; ++cpu)
+                    {
+                        cpus.push_back(cpu);
+                    }
+                    pos = end + 1;
+                }
+
+                return cpus;
+            }
+
+            // Allowed CPUs with their NUMA node, grouped by node
+            static std::vector<std::pair<int, int>> cpu_placement()
+            {
+                cpu_set_t allowed;
+                CPU_ZERO(&allowed);
+                if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0)
+                    return {};
+
+                std::vector<std::pair<int, int>> placement;
+                std::vector<bool> placed(CPU_SETSIZE, false);
+                for (int node = 0; ; ++node)
+                {
+                    std::ifstream file("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist");
+                    std::string list;
+                    if (!file || !std::getline(file, list)) break;
+
+                    for (int cpu : parse_cpulist(list))
+                    {
+                        if (cpu >= 0 && cpu < CPU_SETSIZE && CPU_ISSET(cpu, &allowed) && !placed[cpu])
+                        {
+                            placement.emplace_back(cpu, node);
+                            placed[cpu] = true;
+                        }
+                    }
+                }
+
+                // No NUMA information: everything on node 0
+                for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu)
+                {
+                    if (CPU_ISSET(cpu, &allowed) && !placed[cpu])
+                        placement.emplace_back(cpu, 0);
+                }
+
+                return placement;
+            }
+    };
+
+    // A set of tasks that can be waited for together
+    struct TaskGroup
+    {
+        public:
+
+            ThreadPool& pool;
+
+            explicit TaskGroup(ThreadPool& pool) : pool{pool}
+            {}
+
+            TaskGroup(const TaskGroup&) = delete;
+            TaskGroup& operator=(const TaskGroup&) = delete;
+
+            ~TaskGroup()
+            {
+                drain();
+            }
+
+            template <typename TASK>
+            void run(TASK&& task)
+            {
+                pending.fetch_add(1, std::memory_order_relaxed);
+                pool.submit([this, task = std::forward<TASK>(task)]() mutable
+                {
+                    try
+                    {
+                        task();
+                    }
+                    catch (...)
+                    {
+                        std::lock_guard lock{mutex};
+                        if (!failure) failure = std::current_exception();
+                    }
+
+                    // Notify with the lock held: drain() takes it before returning, so the group outlives this
+                    std::lock_guard lock{mutex};
+                    if (pending.fetch_sub(1, std::memory_order_release) == 1)
+                        done_cv.notify_all();
+                });
+            }
+
+            // Run queued tasks until the group is done, then rethrow the first exception of its tasks
+            void wait()
+            {
+                drain();
+                if (failure) std::rethrow_exception(std::exchange(failure, nullptr));
+            }
+
+        private:
+
+            // Attempts to find a task to run before the waiting thread goes to sleep
+            static constexpr std::size_t SPIN = 64;
+
+            std::atomic<std::size_t> pending{0};
+            std::exception_ptr failure;
+            std::mutex mutex;
+            std::condition_variable done_cv;
+
+            // Help with queued tasks, spinning a little when there is nothing to run, then sleep until the last
+            // task of the group is done. The sleep is bounded, so tasks queued meanwhile are picked up as well.
+            void drain() noexcept
+            {
+                for (std::size_t idle = 0; pending.load(std::memory_order_acquire) > 0; )
+                {
+                    if (pool.run_one())
+                    {
+                        idle = 0;
+                        continue;
+                    }
+                    if (++idle < SPIN)
+                    {
+                        std::this_thread::yield();
+                        continue;
+                    }
+
+                    std::unique_lock lock{mutex};
+                    done_cv.wait_for(lock, std::chrono::milliseconds{1}, [this]{ return pending.load(std::memory_order_acquire) == 0; });
+                }
+
+                // The last task may still hold the lock after its decrement
+                std::lock_guard lock{mutex};
+            }
+    };
+
+    // Call body(first, last) on chunks of at most `grain` indices of [begin, end); grain 0 picks about four
+    // chunks per thread. The calling thread takes part and the call returns when every chunk is done.
+    template <typename BODY>
+    void parallel_for(ThreadPool& pool, std::size_t begin, std::size_t end, std::size_t grain, BODY&& body)
+    {
+        if (begin >= end) return;
+
+        const std::size_t count = end - begin;
+        if (grain == 0)
+            grain = std::max<std::size_t>(1, count / (4 * (pool.size() + 1)));
+
+        if (pool.size() == 0 || count <= grain)
+        {
+            body(begin, end);
+            return;
+        }
+
+        TaskGroup group{pool};
+        for (std::size_t first = begin + grain; first < end; first += grain)
+        {
+            group.run([&body, first, last = std::min(end, first + grain)]{ body(first, last); });
+        }
+        body(begin, std::min(end, begin + grain));
+        group.wait();
+    }
+
+    // The library-wide pool, default_threads() - 1 workers plus the calling thread, which always helps;
+    // the workers are pinned when NN_PIN_THREADS=1
+    inline ThreadPool& default_pool()
+    {
+        static ThreadPool pool{};
+        return pool;
+    }
+
+    namespace detail
+    {
+        inline thread_local ThreadPool* scoped_pool = nullptr;
+    }
+
+    // The pool kernels should use: the one installed by a PoolScope on this thread, the pool of the
+    // calling worker, or the default pool
+    inline ThreadPool& current_pool()
+    {
+        if (detail::scoped_pool) return *detail::scoped_pool;
+        if (ThreadPool* pool = ThreadPool::this_pool()) return *pool;
+
+        return default_pool();
+    }
+
+    // Make `pool` the current pool of this thread while the scope lives
+    struct PoolScope
+    {
+        public:
+
+            explicit PoolScope(ThreadPool& pool) : previous{detail::scoped_pool}
+            {
+                detail::scoped_pool = &pool;
+            }
+
+            PoolScope(const PoolScope&) = delete;
+            PoolScope& operator=(const PoolScope&) = delete;
+
+            ~PoolScope()
+            {
+                detail::scoped_pool = previous;
+            }
+
+        private:
+
+            ThreadPool* previous;
+    };
+}
+
+#endif
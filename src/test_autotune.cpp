@@ -0,0 +1,77 @@
+#include <dense.hpp>
+#include <autotune.hpp>
+#include <iostream>
+#include <cassert>
+#include <cstdlib>
+#include <cstdio>
+
+#define DIM1 64
+#define DIM2 32
+#define BATCH 1
+
+int main(void)
+{
+    // Use a scratch cache file, it has to be set before the first layer is constructed
+    const char* path = "test_autotune.cache";
+    std::remove(path);
+    setenv("NN_TUNING_CACHE", path, 1);
+
+    // Nothing cached yet: the layer keeps the default tile
+    nn::Dense<float, DIM1, DIM2, BATCH> dense{0.01f};
+    assert(dense.kernel_tile == 4);
+
+    // Tuning stores the winner for this CPU and shape
+    std::size_t tile = nn::tune(dense);
+    std::cout << "cpu: " << nn::cpu_model() << "\n";
+    std::cout << "best tile for " << DIM1 << "x" << DIM2 << ": " << tile << "\n";
+
+    // New layers of the same shape pick it up at construction
+    nn::Dense<float, DIM1, DIM2, BATCH> other{0.01f};
+    assert(other.kernel_tile == tile);
+
+    // Every tile size computes the same result
+    std::array<float, DIM1*16> input;
+    for (std::size_t i = 0; i < input.size(); ++i)
+    {
+        input[i] = static_cast<float>(i % 13) / 13.0f;
+    }
+    other.kernel_tile = 1;
+    std::array expected = nn::infer_batch<16>(other, input);
+    for (std::size_t t : {2, 4, 8})
+    {
+        other.kernel_tile = t;
+        assert(nn::infer_batch<16>(other, input) == expected);
+    }
+
+    // And the cache survives a reload from disk
+    nn::TuningCache reloaded{path};
+    assert(reloaded.find(nn::Dense<float, DIM1, DIM2, BATCH>::kernel_key()) == tile);
+
+    // Writers that loaded the file before each other's store must not drop each other's entries
+    nn::TuningCache first{path}, second{path};
+    first.store("first", 1);
+    second.store("second", 2);
+    nn::TuningCache merged{path};
+    assert(merged.find("first") == 1 && merged.find("second") == 2);
+    assert(merged.find(nn::Dense<float, DIM1, DIM2, BATCH>::kernel_key()) == tile);
+
+    // Large layers split their panels across the pool, so the pool size is part of their key; small ones run serially
+    using Large = nn::Dense<float, 512, 512, BATCH>;
+    using Small = nn::Dense<float, DIM1, DIM2, BATCH>;
+    nn::ThreadPool serial{0}, parallel{3};
+    std::string serial_key, parallel_key;
+    {
+        nn::PoolScope scope{serial};
+        serial_key = Large::kernel_key();
+        assert(Small::kernel_threads() == 1);
+    }
+    {
+        nn::PoolScope scope{parallel};
+        parallel_key = Large::kernel_key();
+        assert(Large::kernel_threads() == 4 && Small::kernel_threads() == 1);
+    }
+    assert(serial_key != parallel_key);
+
+    std::remove(path);
+    return 0;
+}
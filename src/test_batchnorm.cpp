@@ -0,0 +1,152 @@
+#include <neuralnet.hpp>
+#include <iostream>
+#include <array>
+#include <cassert>
+#include <cmath>
+#include <vector>
+
+#define DIM1 10
+#define DIM2 4
+#define BATCH 4
+
+std::array<float, DIM1*BATCH> inputs = {0.1, 0.09, 0.02, 0.03, 0.3, 0.5, 0.25, 0.4, 0.33, 0.11,
+                            0.15, 0.10, 0.3, 0.31, 0.2, 0.55, 0.22, 0.4, 0.35, 0.12,
+                            0.6, 0.05, 0.12, 0.7, 0.1, 0.15, 0.9, 0.3, 0.05, 0.2,
+                            0.25, 0.8, 0.4, 0.01, 0.6, 0.35, 0.12, 0.08, 0.5, 0.45};
+
+int main(void)
+{
+    nn::Dense<float, DIM1, DIM2, BATCH> dense{0.01f};
+    nn::BatchNorm<float, DIM2> batchnorm{0.01f, 0.5f};
+
+    // A few training steps so that the running statistics, gamma and beta move away from their defaults
+    for (int step=0; step<5; ++step)
+    {
+        std::vector<std::array<float, DIM2>> hidden;
+        for (int s=0; s<BATCH; ++s)
+        {
+            std::array<float, DIM1> input;
+            std::copy(inputs.begin() + s*DIM1, inputs.begin() + (s+1)*DIM1, input.begin());
+            hidden.push_back(nn::apply(dense, input));
+        }
+
+        std::array<float, DIM2> gradient{};
+        for (const auto& output : nn::apply_batch(batchnorm, hidden))
+        {
+            for (int i=0; i<DIM2; ++i)
+            {
+                gradient[i] += output[i] / BATCH;
+            }
+        }
+        nn::update(dense, nn::update(batchnorm, gradient));
+    }
+
+    std::cout << "running mean: ";
+    for (const auto& i : batchnorm.running_mean)
+    {
+        std::cout << i << " ";
+    }
+    std::cout << "\nrunning var: ";
+    for (const auto& i : batchnorm.running_var)
+    {
+        std::cout << i << " ";
+    }
+    std::cout << "\n";
+
+    // Inference through both layers before folding
+    std::array<float, DIM1> input;
+    std::copy(inputs.begin(), inputs.begin() + DIM1, input.begin());
+    std::array before = nn::infer(batchnorm, nn::infer(dense, input));
+
+    nn::fold(dense, batchnorm);
+    std::array after = nn::infer(dense, input);
+    std::array passthrough = nn::infer(batchnorm, after);
+
+    std::cout << "before folding: ";
+    for (const auto& i : before)
+    {
+        std::cout << i << " ";
+    }
+    std::cout << "\nafter folding: ";
+    for (const auto& i : after)
+    {
+        std::cout << i << " ";
+    }
+    std::cout << "\n";
+
+    for (int i=0; i<DIM2; ++i)
+    {
+        assert(std::abs(before[i] - after[i]) < 1e-4f);
+        assert(passthrough[i] == after[i]);
+    }
+
+    // Every sample of a batch is normalized with the statistics of that batch: with gamma=1 and beta=0 the
+    // outputs average to zero, and near-duplicate samples are spread out instead of collapsing onto the mean
+    nn::BatchNorm<float, DIM2> fresh{0.01f};
+    std::vector<std::array<float, DIM2>> batch;
+    for (int s=0; s<BATCH; ++s)
+    {
+        std::array<float, DIM2> sample = {0.5f, 0.25f, -0.5f, 1.0f};
+        sample[0] += 1e-2f * s;
+        sample[1] = inputs[s];
+        batch.push_back(sample);
+    }
+
+    std::vector normalized = nn::apply_batch(fresh, batch);
+    for (int i=0; i<DIM2; ++i)
+    {
+        float sum = 0.0f;
+        float squares = 0.0f;
+        for (const auto& output : normalized)
+        {
+            sum += output[i];
+            squares += output[i] * output[i];
+        }
+        assert(std::abs(sum) < 1e-4f);
+
+        // Unit variance where the feature varies by more than epsilon, zero where it is constant
+        if (i < 2)
+            assert(std::abs(squares / BATCH - 1.0f) < 0.1f);
+        else
+            assert(squares < 1e-6f);
+    }
+
+    // The accumulated statistics move the running ones on update
+    (void) nn::update(fresh, std::array<float, DIM2>{});
+    assert(std::abs(fresh.running_mean[0] - 0.1f * (0.5f + 1.5e-2f)) < 1e-5f);
+    assert(fresh.running_var[2] < 1.0f);
+
+    // Single-sample batches normalize with the running statistics and still move the running variance
+    nn::BatchNorm<float, DIM2> single{0.01f, 0.5f};
+    for (int s=0; s<BATCH; ++s)
+    {
+        std::array<float, DIM2> sample;
+        std::copy(inputs.begin() + s*DIM2, inputs.begin() + (s+1)*DIM2, sample.begin());
+
+        std::array trained = nn::apply_batch(single, std::vector{sample}).front();
+        std::array served = nn::infer(single, sample);
+        for (int i=0; i<DIM2; ++i)
+        {
+            assert(std::abs(trained[i] - served[i]) < 1e-6f);
+        }
+        (void) nn::update(single, std::array<float, DIM2>{});
+    }
+    for (int i=0; i<DIM2; ++i)
+    {
+        assert(single.running_var[i] != 1.0f);
+    }
+
+    // train() hands every layer the whole batch
+    nn::Dense<float, DIM1, DIM2, BATCH> trained_dense{0.01f};
+    nn::BatchNorm<float, DIM2> trained_batchnorm{0.01f};
+    nn::Loss<nn::MEAN_SQUARED, DIM2> loss;
+    std::array<float, DIM2*BATCH> labels{};
+    float train_error = nn::train<DIM1, DIM2, BATCH, BATCH>(inputs, labels, 1, loss, trained_dense, trained_batchnorm);
+    std::cout << "train error: " << train_error << "\n";
+
+    // With gamma=1 and beta=0 the mean squared output of a batch normalized with its own statistics is one
+    assert(std::abs(train_error - 1.0f) < 1e-3f);
+    assert(trained_batchnorm.running_var[0] != 1.0f);
+
+    return 0;
+}
@@ -1,6 +1,9 @@
 #include <dense.hpp>
 #include <iostream>
 #include <array>
+#include <cassert>
+#include <cmath>
+#include <stdexcept>
 
 #define DIM1 10
 #define DIM2 2
@@ -13,17 +16,35 @@ std::array<float, DIM1*DIM2> initial_weights = {0.1, 0.09, 0.02, 0.03, 0.3, 0.5,
 
 std::array<float, DIM2> initial_biases = {0.1, 0.09};
 
+// infer() must agree with bias + weights * input
+template <typename DENSE>
+std::array<float, DIM2> assert_infers(const DENSE& dense, const std::array<float, DIM1*DIM2>& weights)
+{
+    std::array inferred = nn::infer(dense, input);
+    for (int i=0; i<DIM2; ++i)
+    {
+        float expected = dense.bias_vector[i];
+        for (int j=0; j<DIM1; ++j)
+        {
+            expected += weights[i*DIM1 + j] * input[j];
+        }
+        assert(std::abs(inferred[i] - expected) < 1e-4f);
+    }
+
+    return inferred;
+}
+
 int main(void)
 {
     nn::Dense<float, DIM1, DIM2, 1> dense{std::move(initial_weights), std::move(initial_biases), 0.01f};
     
     // Print the weights and biases before the update
     std::cout << "Weights before:\n";
-    for (int i=0; i<DIM1; ++i)
+    for (int i=0; i<DIM2; ++i)
     {
-        for (int j=0; j<DIM2; ++j)
+        for (int j=0; j<DIM1; ++j)
         {
-            std::cout << dense.weight_matrix[i*DIM2 + j] << " ";
+            std::cout << dense.weights()[i*DIM1 + j] << " ";
         }
         std::cout << "\n";
     }
@@ -59,15 +80,62 @@ int main(void)
     }
     std::cout << "\n\n";
 
-    std::array gradient = nn::update(dense, error);
+    // backprop() only computes the gradients, with respect to the input W^T * error, and step() applies them
+    const std::array<float, DIM1*DIM2> before = dense.weights();
+    std::array gradient = nn::backprop(dense, error);
+    assert(dense.weights() == before);
+    for (int j=0; j<DIM1; ++j)
+    {
+        float expected = 0.0f;
+        for (int i=0; i<DIM2; ++i)
+        {
+            expected += before[i*DIM1 + j] * error[i];
+        }
+        assert(std::abs(gradient[j] - expected) < 1e-5f);
+    }
+    nn::step(dense);
+    assert(dense.weights() != before);
+
+    // The packed copy has to follow the canonical one after the update
+    std::array<float, DIM1*DIM2> canonical = dense.weights();
+    dense.unpack();
+    assert(dense.weights() == canonical && dense.packed_version == dense.version);
+
+    // A reference held across apply() and an edit sees the new weights, and so does inference
+    const std::array<float, DIM1*DIM2>& held = dense.weights();
+    nn::apply(dense, input);
+    nn::edit_weights(dense, [](std::array<float, DIM1*DIM2>& weights){ weights[0] = 100.0f; });
+    assert(held[0] == 100.0f && dense.packed_version == dense.version);
+    assert_infers(dense, held);
+
+    // An edit that fails half way leaves the packed copy stale: inference reads the weights directly
+    // and apply repacks them
+    try
+    {
+        nn::edit_weights(dense, [](std::array<float, DIM1*DIM2>& weights)
+        {
+            weights[DIM1 + 3] += 1.0f;
+            throw std::runtime_error("edit failed");
+        });
+    }
+    catch (const std::runtime_error&)
+    {}
+    assert(dense.packed_version != dense.version);
+    std::array written = assert_infers(dense, held);
+    std::array repacked = nn::apply(dense, input);
+    assert(dense.packed_version == dense.version);
+    for (int i=0; i<DIM2; ++i)
+    {
+        assert(std::abs(repacked[i] - written[i]) < 1e-5f);
+    }
 
     // Print the weights and biases after the update
     std::cout << "Weights after:\n";
-    for (int i=0; i<DIM1; ++i)
+    for (int i=0; i<DIM2; ++i)
     {
-        for (int j=0; j<DIM2; ++j)
+        for (int j=0; j<DIM1; ++j)
         {
-            std::cout << dense.weight_matrix[i*DIM2 + j] << " ";
+            std::cout << dense.weights()[i*DIM1 + j] << " ";
         }
         std::cout << "\n";
     }
@@ -0,0 +1,311 @@
+#include <distributed.hpp>
+#include <iostream>
+#include <vector>
+#include <string>
+#include <cassert>
+#include <cmath>
+#include <utility>
+#include <tuple>
+#include <thread>
+#include <chrono>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+
+#define WORLD 4UL
+#define COUNT 1001UL
+#define BASE_PORT 47100
+
+// Each rank contributes rank + i at index i, so the sum at index i is WORLD*i + WORLD*(WORLD-1)/2
+template <nn::allreduce_t MODE, typename TRANSPORT>
+bool check_allreduce(TRANSPORT& transport, std::size_t world)
+{
+    std::vector<float> values(COUNT);
+    for (std::size_t i = 0; i < COUNT; ++i)
+    {
+        values[i] = static_cast<float>(transport.rank() + i);
+    }
+
+    nn::allreduce<MODE>(transport, std::span<float>{values});
+
+    for (std::size_t i = 0; i < COUNT; ++i)
+    {
+        float expected = static_cast<float>(world * i + world * (world - 1) / 2);
+        if (std::abs(values[i] - expected) > 1e-3f) return false;
+    }
+    return true;
+}
+
+template <typename TRANSPORT>
+bool check_communicator(TRANSPORT& transport, std::size_t world)
+{
+    // Small buckets so that several of them are in flight
+    nn::Communicator<float, TRANSPORT> communicator{transport, 64};
+
+    std::vector<float> first(100, static_cast<float>(transport.rank()));
+    std::vector<float> second(7, static_cast<float>(2 * transport.rank()));
+    communicator.enqueue(std::span<float>{first});
+    communicator.enqueue(std::span<float>{second});
+    communicator.synchronize();
+
+    float mean = static_cast<float>(world - 1) / 2.0f;
+    for (float v : first) if (std::abs(v - mean) > 1e-5f) return false;
+    for (float v : second) if (std::abs(v - 2.0f * mean) > 1e-5f) return false;
+
+    return std::abs(communicator.average(static_cast<float>(transport.rank())) - mean) < 1e-5f;
+}
+
+#define VOCAB 1000UL
+#define EMBEDDING_DIM 4UL
+
+// Rank r looks up row 3r; the gradients are spread onto the union of the rows, averaged and applied everywhere
+template <typename TRANSPORT>
+bool check_embedding(TRANSPORT& transport, std::size_t world)
+{
+    std::vector<float> table(VOCAB*EMBEDDING_DIM, 1.0f);
+    nn::Embedding<float, VOCAB, EMBEDDING_DIM, 1> embedding{std::move(table), 0.5f};
+    nn::Communicator<float, TRANSPORT> communicator{transport, 64};
+
+    const std::size_t rank = transport.rank();
+    nn::apply(embedding, std::array<std::size_t, 1>{3 * rank});
+    nn::backprop(embedding, std::array<float, EMBEDDING_DIM>{1.0f, 1.0f, 1.0f, 1.0f});
+
+    // An untouched row that differs between the ranks must not be exchanged
+    embedding.table[(VOCAB - 1) * EMBEDDING_DIM] = static_cast<float>(rank);
+
+    communicator.enqueue_gradients(embedding);
+    communicator.synchronize();
+    nn::step(embedding);
+
+    if (embedding.updated.size() != world) return false;
+    for (std::size_t r = 0; r < world; ++r)
+    {
+        if (embedding.updated[r] != 3 * r) return false;
+        for (std::size_t k = 0; k < EMBEDDING_DIM; ++k)
+        {
+            if (std::abs(embedding.table[3 * r * EMBEDDING_DIM + k] - (1.0f - 0.5f / world)) > 1e-6f) return false;
+        }
+    }
+    return embedding.table[EMBEDDING_DIM] == 1.0f &&
+        embedding.table[(VOCAB - 1) * EMBEDDING_DIM] == static_cast<float>(rank);
+}
+
+#define TRAIN_DIM 4UL
+#define HIDDEN 3UL
+#define LABELS_DIM 2UL
+#define DEPTH 48UL
+#define BATCH 2UL
+#define EPOCHS 3UL
+
+std::array<float, TRAIN_DIM*DEPTH> train_set;
+std::array<float, LABELS_DIM*DEPTH> labels_set;
+
+// Everything the replicas have to agree on, in a fixed order
+template <typename DENSE_1, typename BATCHNORM, typename DENSE_2>
+std::vector<float> snapshot(const DENSE_1& dense_1, const BATCHNORM& batchnorm, const DENSE_2& dense_2)
+{
+    std::vector<float> values(dense_1.weights().begin(), dense_1.weights().end());
+    values.insert(values.end(), dense_1.bias_vector.begin(), dense_1.bias_vector.end());
+    for (const auto* statistic : {&batchnorm.gamma, &batchnorm.beta, &batchnorm.running_mean, &batchnorm.running_var})
+    {
+        values.insert(values.end(), statistic->begin(), statistic->end());
+    }
+    values.insert(values.end(), dense_2.weights().begin(), dense_2.weights().end());
+    values.insert(values.end(), dense_2.bias_vector.begin(), dense_2.bias_vector.end());
+
+    return values;
+}
+
+// Replicas start from different random weights and train on different batches, but must end up identical,
+// and equal to a single process that averages the gradients of `world` replicas itself
+template <typename TRANSPORT>
+bool check_train(TRANSPORT& transport)
+{
+    const std::size_t world = transport.world();
+    for (std::size_t i = 0; i < train_set.size(); ++i)
+    {
+        train_set[i] = static_cast<float>(i % 11) / 11.0f;
+    }
+    for (std::size_t i = 0; i < labels_set.size(); ++i)
+    {
+        labels_set[i] = static_cast<float>((i / LABELS_DIM + i) % 2);
+    }
+
+    nn::Dense<float, TRAIN_DIM, HIDDEN, BATCH> dense_1{0.01f};
+    nn::BatchNorm<float, HIDDEN> batchnorm{0.01f};
+    nn::Activation<float, nn::SIGMOID, HIDDEN> activation_1{};
+    nn::Dense<float, HIDDEN, LABELS_DIM, BATCH> dense_2{0.01f};
+    nn::Activation<float, nn::SIGMOID, LABELS_DIM> activation_2{};
+    nn::Loss<nn::MEAN_SQUARED, LABELS_DIM> loss;
+
+    // Small buckets, so that the layers are reduced in several pieces while the backward pass goes on
+    nn::Communicator<float, TRANSPORT> communicator{transport, 16};
+
+    // The starting point of the reference, the same on every rank
+    communicator.broadcast_layer(dense_1);
+    communicator.broadcast_layer(dense_2);
+    nn::refresh(dense_1);
+    nn::refresh(dense_2);
+    const std::tuple initial{dense_1, batchnorm, activation_1, dense_2, activation_2};
+
+    float train_loss = nn::train<TRAIN_DIM, LABELS_DIM, DEPTH, BATCH>(train_set, labels_set, EPOCHS, loss, communicator,
+        dense_1, batchnorm, activation_1, dense_2, activation_2);
+
+    // Compare everything with the values of rank 0
+    std::vector<float> mine = snapshot(dense_1, batchnorm, dense_2);
+    mine.push_back(train_loss);
+
+    std::vector<float> reference = mine;
+    nn::broadcast(transport, std::span<float>{reference});
+    if (mine != reference) return false;
+
+    // Single process: every replica backpropagates its batch of the step, then all apply the mean gradient
+    std::vector replicas(world, initial);
+    auto no_hook = [](auto&){};
+    float replica_loss = 0.0f;
+    for (std::size_t epoch = 0; epoch < EPOCHS; ++epoch)
+    {
+        for (std::size_t step = 0; step < (DEPTH / BATCH) / world; ++step)
+        {
+            std::vector<std::vector<std::span<float>>> gradients(world);
+            replica_loss = 0.0f;
+            for (std::size_t r = 0; r < world; ++r)
+            {
+                const std::size_t i = step * world + r;
+                std::apply([&](auto&... layers)
+                {
+                    replica_loss += nn::detail::train_batch<TRAIN_DIM, LABELS_DIM, BATCH>(train_set.data() + i * TRAIN_DIM * BATCH,
+                        labels_set.data() + i * LABELS_DIM * BATCH, loss, no_hook, layers...);
+                    (nn::gradients(layers, [&](std::span<float> values){ gradients[r].push_back(values); }), ...);
+                }, replicas[r]);
+            }
+
+            for (std::size_t g = 0; g < gradients[0].size(); ++g)
+            {
+                for (std::size_t k = 0; k < gradients[0][g].size(); ++k)
+                {
+                    float mean = 0.0f;
+                    for (std::size_t r = 0; r < world; ++r) mean += gradients[r][g][k];
+                    mean /= static_cast<float>(world);
+                    for (std::size_t r = 0; r < world; ++r) gradients[r][g][k] = mean;
+                }
+            }
+
+            for (auto& replica : replicas)
+            {
+                std::apply([](auto&... layers){ (nn::step(layers), ...); }, replica);
+            }
+        }
+    }
+
+    std::vector<float> expected = snapshot(std::get<0>(replicas[0]), std::get<1>(replicas[0]), std::get<3>(replicas[0]));
+    expected.push_back(replica_loss / static_cast<float>(world));
+
+    for (std::size_t k = 0; k < mine.size(); ++k)
+    {
+        if (std::abs(mine[k] - expected[k]) > 1e-5f * (1.0f + std::abs(expected[k]))) return false;
+    }
+    return true;
+}
+
+// Connect to rank 0 and claim to be a rank that does not exist; rank 0 has to drop the connection
+void stray()
+{
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(BASE_PORT);
+    inet_pton(AF_INET, "127.0.0.1", &addr.sin_addr);
+
+    for (int attempt = 0; attempt < 5000; ++attempt)
+    {
+        int fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == 0)
+        {
+            std::uint64_t bogus = 99;
+            ssize_t written = write(fd, &bogus, sizeof(bogus));
+            (void) written;
+            close(fd);
+            return;
+        }
+        close(fd);
+        std::this_thread::sleep_for(std::chrono::milliseconds{1});
+    }
+}
+
+int worker(std::size_t rank, std::size_t world, const std::string& shm_name, std::uint64_t run_id)
+{
+    bool ok = true;
+    {
+        nn::ShmTransport shm{shm_name, rank, world, run_id, 256};
+        ok &= check_allreduce<nn::RING>(shm, world);
+        ok &= check_allreduce<nn::RECURSIVE_HALVING>(shm, world);
+        ok &= check_communicator(shm, world);
+        ok &= check_embedding(shm, world);
+        ok &= check_train(shm);
+    }
+    {
+        std::thread intruder;
+        if (rank == 0) intruder = std::thread{stray};
+        nn::TcpTransport tcp{rank, world, BASE_PORT};
+        if (intruder.joinable()) intruder.join();
+        ok &= check_allreduce<nn::RING>(tcp, world);
+        ok &= check_allreduce<nn::RECURSIVE_HALVING>(tcp, world);
+        ok &= check_communicator(tcp, world);
+        ok &= check_embedding(tcp, world);
+    }
+    return ok ? 0 : 1;
+}
+
+int main(void)
+{
+    // A peer that never shows up makes exchange() time out instead of spinning forever
+    {
+        const std::string name = "/nn_test_distributed_" + std::to_string(getpid()) + "_timeout";
+        nn::ShmTransport lonely{name, 0, 2, static_cast<std::uint64_t>(getpid()), 256, std::chrono::milliseconds{50}};
+        std::uint64_t value = 0;
+        bool timed_out = false;
+        try
+        {
+            lonely.exchange(1, nullptr, 0, 1, &value, sizeof(value));
+        }
+        catch (const std::system_error& error)
+        {
+            timed_out = error.code() == std::errc::timed_out;
+        }
+        assert(timed_out);
+    }
+
+    for (std::size_t world : {2UL, 3UL, WORLD})
+    {
+        std::string shm_name = "/nn_test_distributed_" + std::to_string(getpid()) + "_" + std::to_string(world);
+        std::vector<pid_t> children;
+
+        // A segment left behind by a crashed run must be replaced, not joined
+        int stale = shm_open(shm_name.c_str(), O_CREAT | O_RDWR, 0600);
+        assert(stale >= 0);
+        int resized = ftruncate(stale, 1 << 20);
+        assert(resized == 0);
+        close(stale);
+
+        for (std::size_t rank = 1; rank < world; ++rank)
+        {
+            pid_t pid = fork();
+            if (pid == 0) _exit(worker(rank, world, shm_name, getppid()));
+            children.push_back(pid);
+        }
+
+        int failures = worker(0, world, shm_name, getpid());
+        for (pid_t pid : children)
+        {
+            int status;
+            waitpid(pid, &status, 0);
+            failures += !(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+        }
+
+        std::cout << "world " << world << ": " << (failures == 0 ? "ok" : "FAILED") << "\n";
+        assert(failures == 0);
+    }
+
+    return 0;
+}
@@ -0,0 +1,97 @@
+#include <embedding.hpp>
+#include <iostream>
+#include <array>
+#include <vector>
+#include <cassert>
+#include <cmath>
+#include <stdexcept>
+
+#define VOCAB 1000
+#define DIM 4
+#define BATCH 2
+#define BAG 3
+
+int main(void)
+{
+    // Row i is filled with i
+    std::vector<float> table(VOCAB*DIM);
+    for (std::size_t i = 0; i < table.size(); ++i)
+    {
+        table[i] = static_cast<float>(i / DIM);
+    }
+    nn::Embedding<float, VOCAB, DIM, BATCH, BAG, nn::SUM> embedding{std::vector<float>(table), 0.5f};
+
+    // Id 7 is referenced by both samples, twice by the second one
+    std::array<std::size_t, BAG> bag_1 = {7, 3, 999};
+    std::array<std::size_t, BAG> bag_2 = {7, 7, 42};
+
+    std::array output_1 = nn::apply(embedding, bag_1);
+    std::array output_2 = nn::apply(embedding, bag_2);
+
+    std::cout << "pooled: ";
+    for (const auto& i : output_1)
+    {
+        std::cout << i << " ";
+    }
+    std::cout << "\n";
+    assert(output_1[0] == 7 + 3 + 999 && output_2[0] == 7 + 7 + 42);
+
+    std::array<float, DIM> gradient = {1, 2, 3, 4};
+    nn::update(embedding, gradient);
+
+    // Rows are moved by learning_rate * count / samples * gradient, all the others stay untouched
+    for (std::size_t id = 0; id < VOCAB; ++id)
+    {
+        float count = (id == 7) ? 3 : (id == 3 || id == 42 || id == 999) ? 1 : 0;
+        for (std::size_t k = 0; k < DIM; ++k)
+        {
+            float expected = static_cast<float>(id) - 0.5f * count / BATCH * gradient[k];
+            assert(std::abs(embedding.table[id*DIM + k] - expected) < 1e-5f);
+        }
+    }
+
+    std::cout << "row 7: ";
+    for (std::size_t k = 0; k < DIM; ++k)
+    {
+        std::cout << embedding.table[7*DIM + k] << " ";
+    }
+    std::cout << "\n";
+
+    // Concatenated bags keep one gradient slot per position
+    nn::Embedding<float, VOCAB, DIM, BATCH, 2, nn::CONCAT> concat{std::vector<float>(table), 1.0f};
+    std::array<float, 2> ids = {5, 6};
+    std::array output = nn::infer(concat, ids);
+    assert(output.size() == 2*DIM && output[0] == 5 && output[DIM] == 6);
+
+    nn::apply(concat, ids);
+    std::array<float, 2*DIM> concat_gradient = {1, 1, 1, 1, 2, 2, 2, 2};
+    nn::update(concat, concat_gradient);
+    assert(concat.table[5*DIM] == 4 && concat.table[6*DIM] == 4);
+
+    // Ids outside the vocabulary throw instead of reaching the table, and leave nothing to update
+    for (float bad : {-1.0f, 2.5f, static_cast<float>(VOCAB), std::nanf("")})
+    {
+        bool thrown = false;
+        try
+        {
+            nn::apply(concat, std::array<float, 2>{5, bad});
+        }
+        catch (const std::out_of_range&)
+        {
+            thrown = true;
+        }
+        assert(thrown && concat.touched.empty());
+    }
+    bool thrown = false;
+    try
+    {
+        nn::infer(embedding, std::array<int, BAG>{1, -2, 3});
+    }
+    catch (const std::out_of_range&)
+    {
+        thrown = true;
+    }
+    assert(thrown);
+
+    return 0;
+}
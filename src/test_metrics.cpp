@@ -0,0 +1,36 @@
+#include <metrics.hpp>
+#include <iostream>
+#include <cassert>
+
+#define LABELS 3
+
+int main(void)
+{
+    std::array<float, LABELS> prediction_1 = {0.1, 0.7, 0.2};
+    std::array<float, LABELS> prediction_2 = {0.5, 0.1, 0.4};
+    std::array<float, LABELS> label_1 = {0, 1, 0};
+    std::array<float, LABELS> label_2 = {0, 0, 1};
+
+    // Record into two partial metrics and merge them
+    nn::Metrics<float, LABELS> first, second;
+    nn::record<2>(first, prediction_1.data(), label_1.data());
+    nn::record<2>(second, prediction_2.data(), label_2.data());
+    nn::merge(first, second);
+
+    std::cout << "accuracy: " << first.accuracy() << "\n";
+    std::cout << "top 2 accuracy: " << first.top_k_accuracy() << "\n";
+    std::cout << "confusion:\n";
+    for (int i=0; i<LABELS; ++i)
+    {
+        for (int j=0; j<LABELS; ++j)
+        {
+            std::cout << first.confusion_matrix[i*LABELS + j] << " ";
+        }
+        std::cout << "\n";
+    }
+
+    assert(first.samples == 2 && first.correct == 1 && first.top_k_correct == 2);
+    assert(first.confusion_matrix[1*LABELS + 1] == 1 && first.confusion_matrix[2*LABELS + 0] == 1);
+
+    return 0;
+}
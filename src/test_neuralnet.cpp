@@ -1,38 +1,72 @@
 #include <iostream>
 #include <algorithm>
+#include <random>
 #include <neuralnet.hpp>
 #include <cassert>
 
 #define DIM1 10UL
 #define DIM2 10UL
 #define DIM3 2UL
-#define DEPTH 10UL
+// Ten full evaluation chunks of 1024 samples and a partial one, which ends in a partial block of 16:
+// more chunks than the pool has threads, so the chunks really are spread across them
+#define DEPTH (10UL*1024UL + 7UL*16UL + 5UL)
 
 #define BATCH 1UL
-#define EPOCHS 100UL
+#define EPOCHS 10UL
+
+// Define the input and label sets
+std::array<float, DIM1*DEPTH> train_set;
+std::array<float, DIM3*DEPTH> labels_set;
 
 int main(void)
 {
-    // Define the input and label sets
-    std::array<float, DIM1*DEPTH> train_set; /* = {...}; */
-    std::array<float, DIM3*DEPTH> labels_set; /* = {...}; */
-    
+    // Two classes, told apart by the sign of the sum of the inputs
+    std::default_random_engine engine(42);
+    std::uniform_real_distribution<float> dist(-1.0f, 1.0f);
+    for (std::size_t i = 0; i < DEPTH; ++i)
+    {
+        float sum = 0;
+        for (std::size_t j = 0; j < DIM1; ++j)
+        {
+            sum += (train_set[i*DIM1 + j] = dist(engine));
+        }
+        labels_set[i*DIM3] = (sum > 0) ? 1.0f : 0.0f;
+        labels_set[i*DIM3 + 1] = (sum > 0) ? 0.0f : 1.0f;
+    }
+
     // Define the layers in the network
-    nn::Dense<float, DIM1, DIM2> dense_1{0.01f};
-    nn::Dense<float, DIM2, DIM3> dense_2{0.01f};
+    nn::Dense<float, DIM1, DIM2, BATCH> dense_1{0.01f};
+    nn::Dense<float, DIM2, DIM3, BATCH> dense_2{0.01f};
     nn::Activation<float, nn::SIGMOID, DIM2> activation_1;
-    nn::Activation<float, nn::RELU, DIM3> activation_2;
+    nn::Activation<float, nn::SIGMOID, DIM3> activation_2;
 
     // Define the loss function
     nn::Loss<nn::MEAN_SQUARED, DIM3> loss;
-    
+
     // Call the train function
     float train_error = nn::train<DIM1, DIM3, DEPTH, BATCH>(train_set, labels_set, EPOCHS, loss, dense_1, activation_1, dense_2, activation_2);
 
     // Call the test function
     float test_error = nn::test<DIM1, DIM3, DEPTH>(train_set, labels_set, loss, dense_1, activation_1, dense_2, activation_2);
-    
+
+    // The evaluation must not depend on the number of threads
+    nn::ThreadPool inline_pool{0};
+    nn::ThreadPool pool{4};
+    auto single = nn::evaluate<DIM1, DIM3, DEPTH, 1>(train_set, labels_set, loss, inline_pool, dense_1, activation_1, dense_2, activation_2);
+    auto parallel = nn::evaluate<DIM1, DIM3, DEPTH, 1>(train_set, labels_set, loss, pool, dense_1, activation_1, dense_2, activation_2);
+    float pool_error = nn::test<DIM1, DIM3, DEPTH>(train_set, labels_set, loss, pool, dense_1, activation_1, dense_2, activation_2);
+    assert(single.loss == parallel.loss && single.loss == test_error && pool_error == test_error);
+    assert(single.correct == parallel.correct && single.confusion_matrix == parallel.confusion_matrix);
+    assert(single.samples == DEPTH && single.correct == single.top_k_correct);
+
     // Check if the result is within the expected range
     std::cout << "train_loss:  " << train_error << "\n";
-    std::cout << "test_loss: " << test_error << "\n"; 
+    std::cout << "test_loss: " << test_error << "\n";
+    std::cout << "accuracy: " << parallel.accuracy() << "\n";
+    std::cout << "confusion: ";
+    for (auto count : parallel.confusion_matrix)
+    {
+        std::cout << count << " ";
+    }
+    std::cout << "\n";
 }
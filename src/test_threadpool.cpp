@@ -0,0 +1,123 @@
+#include <threadpool.hpp>
+#include <iostream>
+#include <vector>
+#include <atomic>
+#include <numeric>
+#include <cassert>
+#include <chrono>
+#include <thread>
+#include <cstdlib>
+
+#define COUNT 100000UL
+#define THREADS 4UL
+
+int main(void)
+{
+    nn::ThreadPool pool{THREADS};
+    std::cout << "workers: " << pool.size() << "\n";
+
+    // Every index is visited exactly once
+    std::vector<int> visits(COUNT, 0);
+    nn::parallel_for(pool, 0, COUNT, 0, [&](std::size_t first, std::size_t last)
+    {
+        for (std::size_t i = first; i < last; ++i)
+        {
+            ++visits[i];
+        }
+    });
+    assert(std::all_of(visits.begin(), visits.end(), [](int v){ return v == 1; }));
+
+    // Nested parallel loops on the same pool must not deadlock, even with more outer tasks than workers
+    std::atomic<std::size_t> sum{0};
+    nn::parallel_for(pool, 0, 4 * THREADS, 1, [&](std::size_t first, std::size_t last)
+    {
+        for (std::size_t i = first; i < last; ++i)
+        {
+            nn::parallel_for(nn::current_pool(), 0, 1000, 10, [&](std::size_t a, std::size_t b)
+            {
+                sum += b - a;
+            });
+        }
+    });
+    std::cout << "nested sum: " << sum << "\n";
+    assert(sum == 4 * THREADS * 1000);
+
+    // Exceptions of a task come out of wait()
+    bool caught = false;
+    try
+    {
+        nn::TaskGroup group{pool};
+        group.run([]{ throw std::runtime_error("task failed"); });
+        group.wait();
+    }
+    catch (const std::runtime_error&)
+    {
+        caught = true;
+    }
+    assert(caught);
+
+    // A thread waiting on a long task goes to sleep and is woken up by it
+    std::atomic<bool> finished{false};
+    {
+        nn::TaskGroup group{pool};
+        group.run([&]{ std::this_thread::sleep_for(std::chrono::milliseconds{20}); finished = true; });
+        group.wait();
+    }
+    assert(finished);
+
+    // Scratch arenas are per worker and keep their memory
+    std::atomic<bool> scratch_ok{true};
+    nn::parallel_for(pool, 0, 64, 1, [&](std::size_t first, std::size_t)
+    {
+        std::span<std::byte> scratch = pool.scratch(4096);
+        std::fill(scratch.begin(), scratch.end(), static_cast<std::byte>(first));
+        scratch_ok = scratch_ok && std::all_of(scratch.begin(), scratch.end(), [&](std::byte b){ return b == static_cast<std::byte>(first); });
+    });
+    assert(scratch_ok);
+
+    // A pool without workers runs everything on the caller
+    nn::ThreadPool inline_pool{0};
+    std::size_t visited = 0;
+    nn::parallel_for(inline_pool, 0, 10, 1, [&](std::size_t first, std::size_t last){ visited += last - first; });
+    assert(visited == 10);
+
+    // NN_NUM_THREADS counts the caller; anything that is not a positive number is ignored
+    setenv("NN_NUM_THREADS", "3", 1);
+    assert(nn::ThreadPool::default_threads() == 3 && nn::ThreadPool{}.size() == 2);
+    setenv("NN_NUM_THREADS", "1", 1);
+    assert(nn::ThreadPool{}.size() == 0);
+    setenv("NN_NUM_THREADS", "99999999999999999999", 1);
+    assert(nn::ThreadPool::default_threads() == nn::ThreadPool::MAX_THREADS);
+    const std::size_t hardware = std::max(1u, std::thread::hardware_concurrency());
+    for (const char* invalid : {"-1", "0", "four", "4x", ""})
+    {
+        setenv("NN_NUM_THREADS", invalid, 1);
+        assert(nn::ThreadPool::default_threads() == hardware);
+    }
+    unsetenv("NN_NUM_THREADS");
+
+    // NN_PIN_THREADS=1 binds every worker to a single CPU
+    for (const char* unpinned : {"0", "yes", ""})
+    {
+        setenv("NN_PIN_THREADS", unpinned, 1);
+        assert(!nn::ThreadPool::default_pin_threads());
+    }
+    setenv("NN_PIN_THREADS", "1", 1);
+    assert(nn::ThreadPool::default_pin_threads());
+    {
+        nn::ThreadPool pinned{2};
+        std::atomic<bool> pinned_ok{true};
+        nn::parallel_for(pinned, 0, 64, 1, [&](std::size_t, std::size_t)
+        {
+            if (pinned.worker_index() == pinned.size()) return;
+
+            cpu_set_t set;
+            CPU_ZERO(&set);
+            pinned_ok = pinned_ok && pthread_getaffinity_np(pthread_self(), sizeof(set), &set) == 0 && CPU_COUNT(&set) == 1;
+        });
+        assert(pinned_ok);
+    }
+    unsetenv("NN_PIN_THREADS");
+
+    return 0;
+}